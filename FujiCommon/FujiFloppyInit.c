@@ -105,7 +105,10 @@ static OSErr getDriveAndDrvr(short vRefNum, short *drive, short *drvrRefNum) {
 }
 
 OSErr fujiInit (struct FujiConData *fuji) {
-	fuji->fRefNum = 0;
+	fuji->fRefNum     = 0;
+	fuji->extent      = 1;
+	fuji->directReads = false;
+	fuji->longPollTicks = 0;
 }
 
 Boolean fujiReady (struct FujiConData *fuji) {
@@ -118,7 +121,9 @@ OSErr fujiOpen (struct FujiConData *fuji, short vRefNum) {
 	ParamBlockRec pb;
 	short         i, drvrRefNum, driveNum;
 	long          sectorAddr;
+	short         extent = 1;
 	const char    knockSeq[] = MAC_FUJI_KNOCK_SEQ;
+	const short   FSFCBLen   = *((short *)0x3F6); // FSFCBLen low-memory global
 
 	OSErr err = getDriveAndDrvr (vRefNum, &driveNum, &drvrRefNum); CHECK_ERR;
 
@@ -190,11 +195,37 @@ OSErr fujiOpen (struct FujiConData *fuji, short vRefNum) {
 		sector.values[inOutCount] = MAC_FUJI_REQUEST_TAG;
 	}
 
+	// On HFS, try to give the file FUJI_MAX_EXTENT contiguous sectors, so
+	// that FujiNet can take several sectors in one request. AllocContig
+	// only extends the physical EOF, so the file is emptied first.
+
+	if (FSFCBLen > 0) {
+		DEBUG_STAGE("Allocating");
+
+		inOutCount = 512L * FUJI_MAX_EXTENT;
+		if ((SetEOF (fuji->fRefNum, 0) == noErr) && (AllocContig (fuji->fRefNum, &inOutCount) == noErr)) {
+			extent = FUJI_MAX_EXTENT;
+		}
+	}
+
 	// Write out the magic bytes to the file so FujiNet can learn
-	// the location of the I/O block
+	// the location of the I/O block. The sectors after the first go
+	// out before it, so that firmware which takes the most recent
+	// magic write for the I/O block learns the same one as firmware
+	// which counts the extent from it.
 
 	DEBUG_STAGE("Writing");
 
+	if (extent > 1) {
+		err = SetEOF (fuji->fRefNum, 512L * extent); ON_ERROR(goto cleanup);
+		err = SetFPos (fuji->fRefNum, fsFromStart, 512); ON_ERROR(goto cleanup);
+		for (i = 1; i < extent; i++) {
+			inOutCount = 512;
+			err = FSWrite (fuji->fRefNum, &inOutCount, sector.bytes); ON_ERROR(goto cleanup);
+		}
+		err = SetFPos (fuji->fRefNum, fsFromStart, 0); ON_ERROR(goto cleanup);
+	}
+
 	inOutCount = 512;
 	err = FSWrite (fuji->fRefNum, &inOutCount, sector.bytes); ON_ERROR(goto cleanup);
 
@@ -206,13 +237,32 @@ OSErr fujiOpen (struct FujiConData *fuji, short vRefNum) {
 
 	DEBUG_STAGE("Reading back sector");
 
-	inOutCount = sizeof(unsigned long) * 2;
+	inOutCount = sizeof(unsigned long) * 7;
 	err = FSRead (fuji->fRefNum, &inOutCount, sector.bytes); ON_ERROR(goto cleanup);
 
 	if (sector.values[0] == MAC_FUJI_REPLY_TAG) {
 		sectorAddr = sector.values[1];
+
+		// Older firmware does not report an extent; use one sector at a time
+
+		if ((sector.values[2] == FUJI_EXTENT_TAG) && (sector.values[3] < extent)) {
+			extent = sector.values[3];
+		} else if (sector.values[2] != FUJI_EXTENT_TAG) {
+			extent = 1;
+		}
+
+		// Direct reads use the sectors after the magic one, one per port
+
+		fuji->directReads = (extent > FUJI_NUM_PORTS) && (sector.values[4] == FUJI_DIRECT_READ_TAG);
+
+		// As do long polls, in the one after those
+
+		if ((extent > FUJI_LONG_POLL_SECTOR) && (sector.values[5] == FUJI_LONG_POLL_TAG)) {
+			const unsigned long ms = MIN (sector.values[6], 60000L);
+			fuji->longPollTicks = (short) MAX ((ms * 60 + 999) / 1000, 1);
+		}
 		#if DEBUG
-			printf("Got magic LBA: %ld", sectorAddr);
+			printf("Got magic LBA: %ld, extent: %d, direct reads: %d, long polls: %d", sectorAddr, extent, fuji->directReads, fuji->longPollTicks);
 		#endif
 	} else {
 		#if DEBUG
@@ -233,8 +283,7 @@ OSErr fujiOpen (struct FujiConData *fuji, short vRefNum) {
 	fuji->iopb.ioPosMode    = fsFromStart;
 	fuji->iopb.ioPosOffset  = 512L * (long) sectorAddr;
 	fuji->iopb.ioVRefNum    = driveNum;
-
-	err = OpenDriver(FUJI_DRVR_NAME, &drvrRefNum);
+	fuji->extent            = MAX (extent, 1);
 
 cleanup:
 	//DEBUG_STAGE("Enabling Cache\n");
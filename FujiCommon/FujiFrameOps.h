@@ -0,0 +1,114 @@
+/****************************************************************************
+ *   mac68k-fuji-drivers (c) 2024 Marcio Teixeira                           *
+ *                                                                          *
+ *   This program is free software: you can redistribute it and/or modify   *
+ *   it under the terms of the GNU General Public License as published by   *
+ *   the Free Software Foundation, either version 3 of the License, or      *
+ *   (at your option) any later version.                                    *
+ *                                                                          *
+ *   This program is distributed in the hope that it will be useful,        *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of         *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the          *
+ *   GNU General Public License for more details.                           *
+ *                                                                          *
+ *   To view a copy of the GNU General Public License, go to the following  *
+ *   location: <http://www.gnu.org/licenses/>.                              *
+ ****************************************************************************/
+
+#pragma once
+
+#include "FujiLink.h"
+
+/**
+ * Routines for building and taking apart the payload of packed sectors, as
+ * described in "FujiLink.h". A payload being built or taken apart is called
+ * a frame, and offsets into it are in bytes. These only use plain C so that
+ * the host tools can share them; like "FujiRingOps.h", this file generates
+ * code and must not be included above a driver's main().
+ */
+
+/* Returns how many bytes of data a new record could hold in a frame of
+ * capacity bytes, of which used are already taken.
+ */
+
+static long frameRoom (long used, long capacity) {
+	long room = capacity - used - FUJI_RECORD_HEADER_SIZE;
+	if (room > FUJI_RECORD_MAX) {
+		room = FUJI_RECORD_MAX;
+	}
+	return (room > 0) ? room : 0;
+}
+
+/* Adds a record for len bytes of a port's data to a frame. The caller must
+ * already have put the data at frame + *used + FUJI_RECORD_HEADER_SIZE, and
+ * checked that it fits with frameRoom.
+ */
+
+static void frameAppend (unsigned char *frame, long *used, unsigned char port, long len) {
+	unsigned char *rec = frame + *used;
+	rec[0] = (unsigned char) ((port << 4) | (len >> 8));
+	rec[1] = (unsigned char) len;
+	*used += FUJI_RECORD_HEADER_SIZE + len;
+}
+
+/* Returns true if there are no more records at offset in a frame of len bytes */
+
+static int frameAtEnd (const unsigned char *frame, long offset, long len) {
+	return (offset + FUJI_RECORD_HEADER_SIZE > len) || (FUJI_RECORD_PORT (frame + offset) == FUJI_PORT_NONE);
+}
+
+/* Returns the offset of the record after the one at offset */
+
+static long frameNext (const unsigned char *frame, long offset) {
+	return offset + FUJI_RECORD_HEADER_SIZE + FUJI_RECORD_LENGTH (frame + offset);
+}
+
+/* Returns true if every record in a frame of len bytes is for a port in
+ * 1..ports and lies within the frame. Frames from the link should be checked
+ * with this once, so that the other routines need not.
+ */
+
+static int frameValid (const unsigned char *frame, long len, unsigned char ports) {
+	long offset = 0;
+	while (!frameAtEnd (frame, offset, len)) {
+		if (FUJI_RECORD_PORT (frame + offset) > ports || frameNext (frame, offset) > len) {
+			return 0;
+		}
+		offset = frameNext (frame, offset);
+	}
+	return 1;
+}
+
+/* Returns how many bytes of data for port are in the records of a frame of
+ * len bytes, starting with the one at offset.
+ */
+
+static long frameCount (const unsigned char *frame, long offset, long len, unsigned char port) {
+	long count = 0;
+	while (!frameAtEnd (frame, offset, len)) {
+		if (FUJI_RECORD_PORT (frame + offset) == port) {
+			count += FUJI_RECORD_LENGTH (frame + offset);
+		}
+		offset = frameNext (frame, offset);
+	}
+	return count;
+}
+
+/* Marks the first n bytes of data of the record at offset as taken, and
+ * returns the offset to carry on from. If only part of the record was taken,
+ * a header for the rest is written over the tail of the taken bytes, so the
+ * frame can be picked up again later from the returned offset.
+ */
+
+static long frameConsume (unsigned char *frame, long offset, long n) {
+	const unsigned char port = FUJI_RECORD_PORT    (frame + offset);
+	const long          len  = FUJI_RECORD_LENGTH  (frame + offset);
+
+	if (n >= len) {
+		return offset + FUJI_RECORD_HEADER_SIZE + len;
+	}
+	offset += n;
+	frame[offset]     = (unsigned char) ((port << 4) | ((len - n) >> 8));
+	frame[offset + 1] = (unsigned char) (len - n);
+	return offset;
+}
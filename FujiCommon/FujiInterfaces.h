@@ -19,6 +19,9 @@
 
 #include <stddef.h>
 
+#include "FujiLink.h"
+#include "FujiRing.h"
+
 #define USE_WRITE_BUFFER 1
 
 #define FUJI_DRVR_NAME "\p.Fuji"  // Only installed if STANDALONE_FUJI_DRIVER is 1
@@ -45,17 +48,94 @@
 
 #define NELEMENTS(a) (sizeof(a)/sizeof(a[0]))
 
+/* Number of drivers we may install or override:
+ *
+ * (.Fuji, .AOut, .AIn, .BOut., .Bin, .IPP) = 6
+ */
+#define MAX_FUJI_UNITS 6
+
 struct DriverInfo {
-	short              refNum;
 	IOParam           *pendingPb;
 	DCtlEntry         *pendingDce;
 };
 
+/* Requests suspended in doPrime, indexed by unit number. The pending bitmap
+ * has one bit per unit with a request waiting, so that wake-ups only visit
+ * those units. The registry covers every entry of the unit table and is
+ * replaced by a larger copy if the unit table grows.
+ */
+
+struct DriverRegistry {
+	short              count;     // Number of units covered
+	unsigned char     *pending;   // Bitmap, (count + 7) / 8 bytes
+	struct DriverInfo  info[1];   // Actually count entries
+};
+
+#define DRIVER_REGISTRY_SIZE(n) (sizeof(struct DriverRegistry) + \
+                                 ((n) - 1) * sizeof(struct DriverInfo) + \
+                                 (((n) + 7) >> 3))
+
+/* State for each port sharing the link. Output ports are served by deficit
+ * round robin: each round, a port may send weight * SCHED_QUANTUM bytes.
+ * Output that is less than a sector and arrives while the link is busy is
+ * held back for up to coalesceTicks, so that more can join it.
+ * Input is demultiplexed from the read buffers into inRing, which uses the
+ * driver's own buffer unless the application supplies one with SerSetBuf.
+ */
+
+struct FujiPort {
+	struct FujiRing    outRing;   // Output not yet staged in writeData
+	short              weight;    // Share of the link, in quanta per round
+	long               deficit;   // Bytes the port may still send this round
+	unsigned char      coalesceTicks; // Longest that output is held back
+	unsigned long      coalesceFrom;  // Ticks when the oldest output was queued
+
+	struct FujiRing    inRing;    // Input taken out of the read buffers
+	Ptr                inDefault; // Driver's input buffer, for SerSetBuf 0
+	long               inDefaultSize;
+
+	// Each ring has one producer and one consumer, and so needs no mutex;
+	// these make sure that requests for a port that is shared by several
+	// drivers take turns at their end of the rings
+
+	unsigned char      inBusy;    // Taken while a request takes from inRing
+	unsigned char      outBusy;   // Taken while a request puts into outRing
+};
+
+// Driver-specific control calls on .Fuji
+
+#define FUJI_CTL_SET_WEIGHT 128   // csParam[0] = FUJI_PORT_*, csParam[1] = weight
+#define FUJI_CTL_SET_COALESCE 129 // csParam[0] = FUJI_PORT_*, csParam[1] = ticks
+#define FUJI_CTL_SET_LONG_POLL 130 // csParam[0] = longest hold allowed, in ticks
+
+// States of the link, in FujiSerData.linkState
+
+#define LINK_IDLE     0   // Nothing on the bus; the VBL task will poll
+#define LINK_READING  1   // A read is on the bus
+#define LINK_WRITING  2   // A write is on the bus
+#define LINK_WAKING   3   // Between transfers, completing queued requests
+#define LINK_RECOVERING 4 // Knocking to reconnect after an error
+
 struct FujiConData {
 	volatile IOParam   iopb;
 	short              fRefNum;
+	short              extent;    // Sectors per request, agreed by fujiOpen
+	Boolean            directReads; // Host takes direct reads, see FujiLink.h
+	short              longPollTicks; // Longest the host holds a long poll, or 0
 } ;
 
+// A sector of output, as staged by the Async driver
+
+struct FujiWriteSector {
+	OSType         id;
+	char           src;
+	char           dst;
+	short          length;
+	unsigned short credit;  // See FujiLink.h
+	short          reserved;
+	char           payload[500];
+};
+
 struct StorageSpec {
 	// WARNING: The ordering and size of this data structure must
 	//          match the corresponding fields in IOParam
@@ -69,43 +149,137 @@ struct FujiSerData {
 	struct FujiConData conn;
 	OSType             id;
 
-	/* Length of driver info table is one more than the
-	 * number of drivers we may override:
-	 *
-	 * (.Fuji, .AOut, .AIn, .BOut., .Bin, .IPP) + 1 = 7
+	// Allocated by fujiSerialInstall; only replaced with interrupts masked
+
+	struct DriverRegistry * volatile drvrs;
+
+	// Names and unit numbers of the drivers that share this storage, as
+	// installed by installDCE. Lets status queries skip the unit table scan.
+
+	struct {
+		Str15          name;
+		short          unitNum;
+	} units[MAX_FUJI_UNITS];
+
+	/* Reads and writes are double buffered. For each direction, the "front"
+	 * buffer (readIdx/writeIdx) is the one being filled or drained, while
+	 * the "back" buffer (the other index) is the one on the bus. This lets
+	 * applications drain input, and the output ring be staged, while a
+	 * transfer is in flight. Indices are only swapped while holding the
+	 * buffer mutex.
 	 */
-	struct DriverInfo  drvrInfo[7];
 
 	struct {
 		OSType         id;
 		char           src;
 		char           dst;
 		short          avail;
-		long           reserved;
+		unsigned short credit;      // See FujiLink.h
+		short          reserved;
 		char           payload[500];
-	} readData;
+	} readData[2];
 
-	struct StorageSpec readStorage;
+	struct StorageSpec readStorage[2];
 	unsigned long      readExtraAvail;
+	unsigned char      readIdx;
+	unsigned char      readExtraPort;  // Port of the last sector read
+
+	// Bytes the host can still accept, from the credit in its last reply
+	// less what was written since, or -1 if the host has no flow control
+
+	long               hostCredit;
+	Boolean            hostPacks;      // Host accepts packed sectors
+	Boolean            hostTags;       // Host reads the tags of writes
+
+	// Sequence numbers, see FujiLink.h
+
+	unsigned short     txSeq;          // Number of the next sector written
+	unsigned short     rxSeq;          // Expected on the next reply, or 0
+
+	// A write being sent straight from its caller's buffer, see doPrime
+
+	IOParam           *directPb;
+	unsigned char      directPort;
+	Boolean            directLast;     // Went before the output rings last
+	unsigned short     directSeq;      // Number of its first sector on the bus
+
+	// A read being filled straight from the host, see doPrime
+
+	IOParam           *directReadPb;
+	unsigned char      directReadPort;
+	Boolean            directReadLast; // Went before the read buffers last
+
+	// Ports sharing the link, indexed by FUJI_PORT_* - 1. The port rings
+	// are allocated in the system heap by fujiSerialInstall.
+
+	struct FujiPort    ports[FUJI_NUM_PORTS];
+	unsigned char      schedPort;      // Port being served by the scheduler
+	unsigned char      lastWritePort;  // Gets replies from hosts without ports
+	unsigned char      openCount;      // Units open, see doOpen
 
-	volatile Boolean   inWakeUp;
+	// Link state machine, see linkNext in FujiSerialAsync.c. Only changed
+	// while holding the VBL mutex.
+
+	volatile unsigned char linkState; // LINK_*, below
+	Boolean            readDue;     // The last write left the host with input
+	Boolean            hostStreaming; // The last read brought input
+	Boolean            longPollOut; // The read on the bus is a long poll
+	unsigned char      longPollLimit; // Longest hold allowed, in ticks
+	unsigned char      idlePolls;   // Polls in a row at VBL_TICKS_MAX with no traffic
 
 	long               bytesWritten;
 	long               bytesRead;
 
-	unsigned char vblCount;
+	unsigned char      vblCount;    // Current poll interval, in ticks
+	Boolean            linkActive;  // Data moved since the last poll
+
+	unsigned long      chainedStarts; // Transfers started as one completed
+	unsigned long      vblStarts;     // Transfers started by the VBL task
+	unsigned long      queuedStarts;  // Writes queued behind the one on the bus
+
+	// Reconnecting after an error, see startRecovery in FujiSerialAsync.c.
+	// The error stays in conn.iopb.ioResult until the link is back.
+
+	IOParam            recoverPb;
+	OSType             recoverSector[512 / sizeof(OSType)];
+	unsigned char      recoverStep;  // Transfer of the attempt on the bus
+	Boolean            linkDown;     // The error has been seen
+	unsigned short     recoverWait;  // Ticks from a failed attempt to the next
+	unsigned long      recoverAt;    // Ticks of the next attempt
+	unsigned long      downSince;    // Ticks when the error was seen
+
+	unsigned long      recoveries;   // Times the link came back
+	unsigned long      recoverFails; // Attempts that failed
+	unsigned long      downTicks;    // Ticks the link was down, until it came back
+
+	// Error counts, for SerStatus and monitoring. The cumErrs flags use the
+	// Serial Driver error bits and are cleared by each SerStatus call.
+
+	unsigned long      ioErrors;    // Failed reads or writes of the sector
+	unsigned long      tagErrors;   // Replies without MAC_FUJI_REPLY_TAG,
+	                                // or with malformed packed records
+	unsigned long      seqDups;     // Replies dropped as duplicates
+	unsigned long      seqGaps;     // Replies that followed missing ones
+	unsigned char      cumErrs;
 
 	#if USE_WRITE_BUFFER
-		struct {
-			OSType     id;
-			char       src;
-			char       dst;
-			short      length;
-			long       reserved;
-			char       payload[500];
-		} writeData;
-
-		struct StorageSpec writeStorage;
+		// Sectors sent in one request. Each buffer holds writeExtent of
+		// them, which is the extent agreed on by the first fujiOpen; see
+		// newWriteBuffers in FujiSerialInit.c.
+
+		struct FujiWriteSector *writeData[2];
+		unsigned char      writeExtent;
+
+		struct StorageSpec writeStorage[2];   // ioActCount sums all sectors
+		unsigned char      writeSectors[2];   // Sectors staged in writeData
+		unsigned char      writeIdx;
+
+		// Each write buffer is sent with its own parameter block, so that
+		// the write of one can be queued on the disk driver behind that
+		// of the other. See queueWrite in FujiSerialAsync.c.
+
+		IOParam            writePb[2];
+		unsigned char      writesOut;         // Writes of the buffers on the bus
 	#endif
 } ;
 
@@ -158,8 +332,8 @@ Declare_LoMem(volatile unsigned long,  BufTgDate,   0x304);
 #define FUJI_TAG_SRC  BufTgFFlag
 #define FUJI_TAG_LEN  BufTgFBkNum
 
-STATIC_ASSERT( MEMBER_SIZE(struct FujiSerData, readData)  == 512 , fuji_ser_data_r_size);
-STATIC_ASSERT( MEMBER_SIZE(struct FujiSerData, writeData) == 512 ,fuji_ser_data_w_size);
+STATIC_ASSERT( MEMBER_SIZE(struct FujiSerData, readData[0])  == 512 , fuji_ser_data_r_size);
+STATIC_ASSERT( sizeof(struct FujiWriteSector) == 512 ,fuji_ser_data_w_size);
 STATIC_ASSERT( offsetof(struct StorageSpec,ioBuffer)   == 0, ss_test_1);
 STATIC_ASSERT( offsetof(struct StorageSpec,ioReqCount) == (offsetof(IOParam,ioReqCount) - offsetof(IOParam,ioBuffer)), ss_test_2);
 STATIC_ASSERT( offsetof(struct StorageSpec,ioActCount) == (offsetof(IOParam,ioActCount) - offsetof(IOParam,ioBuffer)), ss_test_3);
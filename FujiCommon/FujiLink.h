@@ -0,0 +1,211 @@
+/****************************************************************************
+ *   mac68k-fuji-drivers (c) 2024 Marcio Teixeira                           *
+ *                                                                          *
+ *   This program is free software: you can redistribute it and/or modify   *
+ *   it under the terms of the GNU General Public License as published by   *
+ *   the Free Software Foundation, either version 3 of the License, or      *
+ *   (at your option) any later version.                                    *
+ *                                                                          *
+ *   This program is distributed in the hope that it will be useful,        *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of         *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the          *
+ *   GNU General Public License for more details.                           *
+ *                                                                          *
+ *   To view a copy of the GNU General Public License, go to the following  *
+ *   location: <http://www.gnu.org/licenses/>.                              *
+ ****************************************************************************/
+
+#pragma once
+
+/**
+ * Fields of the sector header exchanged over the FujiNet link, shared by the
+ * driver and the host. Like "FujiRing.h", this only uses plain C so that it
+ * can be included by the host tools in linux/.
+ *
+ * Every sector starts with a 12-byte big-endian header:
+ *
+ *    offset  size  from the Mac ('NDEV')   from the host ('FUJI')
+ *    0       4     id                      id
+ *    4       1     src                     src
+ *    5       1     dst                     dst
+ *    6       2     length of payload       bytes available, including payload
+ *    8       2     credit                  credit
+ *    10      2     sequence number         sequence number
+ *    12      500   payload                 payload
+ */
+
+#define FUJI_SECTOR_SIZE        512
+#define FUJI_HEADER_SIZE        12
+#define FUJI_PAYLOAD_SIZE       500
+
+/**
+ * Credit based flow control: each side advertises in every sector how many
+ * more payload bytes it can accept. A sender never sends more than the
+ * credit it was last given, less what it has sent since. Peers which predate
+ * flow control leave the field as zero, which means "no limit"; so that a
+ * credit of zero can be told apart from that, valid credits have the top bit
+ * set.
+ */
+
+#define FUJI_CREDIT_VALID       0x8000
+#define FUJI_CREDIT_MAX         0x7FFF
+
+#define FUJI_CREDIT(bytes)      (FUJI_CREDIT_VALID | (((bytes) < FUJI_CREDIT_MAX) ? (bytes) : FUJI_CREDIT_MAX))
+#define FUJI_HAS_CREDIT(credit) (((credit) & FUJI_CREDIT_VALID) != 0)
+#define FUJI_CREDIT_BYTES(credit) ((credit) & FUJI_CREDIT_MAX)
+
+/**
+ * Sequence numbers: each side numbers the sectors it sends, counting up by
+ * one per sector, so that the other can tell when one arrives twice or out
+ * of order, as could happen once the Mac has several requests queued on the
+ * disk driver. A sector numbered up to FUJI_SEQ_WINDOW before the one
+ * expected is a duplicate and is dropped.
+ *
+ * The host also drops a sector from the Mac numbered ahead of the one
+ * expected, since the Mac sends the missing ones again, in order and with
+ * the same numbers, once it has knocked to reconnect; only the first sector
+ * after a knock may start the count anew. The Mac takes any other number
+ * than the one expected from the host, which does not send again, to mean
+ * that sectors went missing, and the count carries on from it.
+ *
+ * The header of a direct write or direct read, which is the same for every
+ * sector of the request, carries the number of its first sector. A direct
+ * write sent again after a knock goes from where the failed one did, and
+ * carries the number that one had. Peers which predate this leave the
+ * field as zero; like credits, valid numbers have the top bit set.
+ */
+
+#define FUJI_SEQ_VALID          0x8000
+#define FUJI_SEQ_MASK           0x7FFF
+#define FUJI_SEQ_WINDOW         64
+
+#define FUJI_SEQ(n)             (FUJI_SEQ_VALID | ((n) & FUJI_SEQ_MASK))
+#define FUJI_HAS_SEQ(seq)       (((seq) & FUJI_SEQ_VALID) != 0)
+#define FUJI_SEQ_AHEAD(seq, expected) (((seq) - (expected)) & FUJI_SEQ_MASK)
+#define FUJI_SEQ_DUPLICATE(seq, expected) \
+	(FUJI_SEQ_AHEAD (expected, seq) != 0 && FUJI_SEQ_AHEAD (expected, seq) <= FUJI_SEQ_WINDOW)
+
+/**
+ * Ports multiplexed over the link, identified by the src byte of sectors
+ * from the Mac and the dst byte of sectors from the host. Peers which
+ * predate ports leave these as zero; the Mac then delivers the host's
+ * replies to the port it last wrote from.
+ */
+
+#define FUJI_PORT_NONE          0
+#define FUJI_PORT_MODEM         1   // .AIn and .AOut
+#define FUJI_PORT_PRINTER       2   // .BIn and .BOut
+#define FUJI_PORT_OTHER         3   // .Fuji and .IPP
+#define FUJI_NUM_PORTS          3
+
+/**
+ * Packed sectors carry data for several ports at once, so that a keystroke
+ * for one port can ride along with another port's data rather than cost a
+ * sector of its own. A packed sector has FUJI_PORT_PACKED in place of the
+ * port, and a payload made of records, each a 2-byte big-endian header
+ * (port in the top 4 bits, length in the other 12) followed by that many
+ * bytes of data. A zero header, or the end of the payload, ends the records.
+ *
+ * Each side only sends packed sectors to a peer that has said it accepts
+ * them, by putting FUJI_PORT_PACKED in the byte that does not carry a port:
+ * dst in sectors from the Mac, src in those from the host. The routines to
+ * build and take apart packed payloads are in "FujiFrameOps.h".
+ */
+
+#define FUJI_PORT_PACKED        0x7F
+
+#define FUJI_RECORD_HEADER_SIZE 2
+#define FUJI_RECORD_MAX         0x0FFF
+
+#define FUJI_RECORD_PORT(rec)   (((const unsigned char*)(rec))[0] >> 4)
+#define FUJI_RECORD_LENGTH(rec) (((((const unsigned char*)(rec))[0] & 0x0F) << 8) | ((const unsigned char*)(rec))[1])
+
+/**
+ * Multi-sector transfers: FujiNet.ndev may span up to FUJI_MAX_EXTENT
+ * contiguous sectors, starting with the magic sector. A request to read or
+ * write several of them at once carries one complete sector, header and
+ * all, in each, and the host handles them in order as if they had been
+ * separate requests. This pays for the per-request handshake on the bus
+ * once per burst instead of once per sector.
+ *
+ * When the Mac writes the magic pattern to every sector of the file and
+ * reads back the first, a host that supports this answers with:
+ *
+ *    offset  size
+ *    0       4     'FUJI'
+ *    4       4     LBA of the magic sector
+ *    8       4     FUJI_EXTENT_TAG
+ *    12      4     number of contiguous sectors it found and will accept
+ *    16      4     FUJI_DIRECT_READ_TAG, if it takes direct reads (below)
+ *    20      4     FUJI_LONG_POLL_TAG, if it takes long polls (below)
+ *    24      4     longest it holds a long poll, in milliseconds
+ *
+ * Older hosts only fill in the first 8 bytes, and get one sector at a time.
+ */
+
+#define FUJI_MAX_EXTENT         5
+#define FUJI_EXTENT_TAG         0x58544E54  // 'XTNT'
+#define FUJI_DIRECT_READ_TAG    0x44524354  // 'DRCT'
+#define FUJI_LONG_POLL_TAG      0x4C504F4C  // 'LPOL'
+
+/**
+ * Write status: a host may answer each write with its status in the 12 tag
+ * bytes of the sector, which the Mac finds in the low-memory tag globals
+ * (BufTgFNum onwards) once the write completes:
+ *
+ *    offset  size
+ *    0       4     'FUJI'
+ *    4       2     credit
+ *    6       2     bytes available for the Mac
+ *    8       4     FUJI_STATUS_TAG
+ *
+ * The tags are left as the Mac set them by hosts that do not do this, so
+ * the Mac clears them before each write that is framed by its data. When
+ * the host reports that it has nothing for the Mac, the read that would
+ * otherwise follow the write is skipped.
+ */
+
+#define FUJI_STATUS_TAG         0x53544154  // 'STAT'
+
+/**
+ * Direct writes: once a host has answered a write with its status, and so
+ * is known to read tags, the Mac may send large writes straight from the
+ * application's buffer. The sector header then travels in the tags rather
+ * than the data, laid out as in the first 12 bytes of a sector from the Mac,
+ * and all 512 bytes of each sector are payload. Every sector of a direct
+ * write is full, so the length in the tags is FUJI_SECTOR_SIZE. A host tells
+ * the two apart by the id, which the Mac clears from the tags of other
+ * writes.
+ *
+ * Direct reads: a host that has at least FUJI_NUM_PORTS + 1 sectors in the
+ * extent, and says it takes direct reads, lets the Mac read a sector of one
+ * port's data straight into the application's buffer. The Mac asks for it
+ * by reading the sector of the extent whose number is that of the port,
+ * rather than the magic sector. The host answers with the header of a
+ * sector from the host in the tags, with dst set to the port, and up to
+ * FUJI_SECTOR_SIZE bytes of that port's data from the start of the sector.
+ * The bytes available are those of the port, and since the Mac only asks
+ * when the application has room for a whole sector, they are not limited
+ * by its credit.
+ */
+
+/**
+ * Long polls: a host that has more than FUJI_LONG_POLL_SECTOR sectors in the
+ * extent, and says it takes long polls, may hold a read of that sector of
+ * the extent until it has data for the Mac, or for up to the time it gave,
+ * and then answers as it would a read of the magic sector. The Mac only asks
+ * for one once the link has been idle for a few seconds, since nothing else
+ * can use the bus while it is held. The time given should leave a margin
+ * below the point where the Mac's disk driver would give up on the sector.
+ */
+
+#define FUJI_LONG_POLL_SECTOR   (FUJI_NUM_PORTS + 1)
+
+/**
+ * Small payloads are not carried in the tags. The .Sony driver only moves
+ * whole 512-byte sectors, and the tags of each sector travel in addition
+ * to its data, so a request costs the same however little of the sector is
+ * used. Interactive traffic is made cheaper instead by packed sectors,
+ * which let it share a sector with other ports, and by the write status,
+ * which saves the empty read after a write.
+ */
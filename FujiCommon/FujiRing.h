@@ -0,0 +1,36 @@
+/****************************************************************************
+ *   mac68k-fuji-drivers (c) 2024 Marcio Teixeira                           *
+ *                                                                          *
+ *   This program is free software: you can redistribute it and/or modify   *
+ *   it under the terms of the GNU General Public License as published by   *
+ *   the Free Software Foundation, either version 3 of the License, or      *
+ *   (at your option) any later version.                                    *
+ *                                                                          *
+ *   This program is distributed in the hope that it will be useful,        *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of         *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the          *
+ *   GNU General Public License for more details.                           *
+ *                                                                          *
+ *   To view a copy of the GNU General Public License, go to the following  *
+ *   location: <http://www.gnu.org/licenses/>.                              *
+ ****************************************************************************/
+
+#pragma once
+
+/**
+ * A byte ring used by the drivers to queue data between applications and
+ * the FujiNet link. This header only uses plain C types so that it can also
+ * be built on the host; the routines that operate on a ring live in
+ * "FujiRingOps.h".
+ *
+ * "head" is the offset of the next byte to be put and "tail" the offset of
+ * the next byte to be taken. One byte is always left unused, so that a full
+ * ring can be told apart from an empty one.
+ */
+
+struct FujiRing {
+	char          *buffer;
+	long           size;
+	volatile long  head;
+	volatile long  tail;
+};
@@ -0,0 +1,127 @@
+/****************************************************************************
+ *   mac68k-fuji-drivers (c) 2024 Marcio Teixeira                           *
+ *                                                                          *
+ *   This program is free software: you can redistribute it and/or modify   *
+ *   it under the terms of the GNU General Public License as published by   *
+ *   the Free Software Foundation, either version 3 of the License, or      *
+ *   (at your option) any later version.                                    *
+ *                                                                          *
+ *   This program is distributed in the hope that it will be useful,        *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of         *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the          *
+ *   GNU General Public License for more details.                           *
+ *                                                                          *
+ *   To view a copy of the GNU General Public License, go to the following  *
+ *   location: <http://www.gnu.org/licenses/>.                              *
+ ****************************************************************************/
+
+#pragma once
+
+#include "FujiRing.h"
+
+/**
+ * Routines for struct FujiRing. These are static so that each driver gets
+ * its own copy; like "LedIndicators.h", this file generates code and must
+ * not be included above a driver's main().
+ *
+ * Host builds should define FUJI_RING_COPY(src, dst, len) in terms of memmove
+ * before including it; note that BlockMove takes its arguments source first.
+ *
+ * A ring may be put into by one context while another takes from it, with
+ * no mutex: ringPut only stores head and ringGet only stores tail, each
+ * once its bytes have been copied, and each reads the other's index before
+ * copying. On the Mac the two contexts are an application and interrupt
+ * code on one processor, and a long store cannot be split by an interrupt.
+ * Host builds that put and take on different threads should also define
+ * FUJI_RING_BARRIER() as a memory barrier.
+ */
+
+#ifndef FUJI_RING_COPY
+	#define FUJI_RING_COPY(src, dst, len) BlockMove (src, dst, len)
+#endif
+
+#ifndef FUJI_RING_BARRIER
+	#define FUJI_RING_BARRIER()
+#endif
+
+/* Copies of no more than FUJI_SMALL_COPY bytes, such as the single bytes
+ * that terminal programs read and write, are done with a loop; for them the
+ * BlockMove trap dispatch costs more than the copy itself.
+ */
+
+#ifndef FUJI_SMALL_COPY
+	#define FUJI_SMALL_COPY 16
+#endif
+
+static void fujiCopy (const char *src, char *dst, long len) {
+	if (len <= FUJI_SMALL_COPY) {
+		while (len-- > 0) {
+			*dst++ = *src++;
+		}
+	} else {
+		FUJI_RING_COPY (src, dst, len);
+	}
+}
+
+static long ringUsed (const struct FujiRing *ring) {
+	const long used = ring->head - ring->tail;
+	return (used < 0) ? used + ring->size : used;
+}
+
+static long ringFree (const struct FujiRing *ring) {
+	return (ring->size > 0) ? ring->size - 1 - ringUsed (ring) : 0;
+}
+
+/* Copies up to len bytes from src into the ring, returning the count copied */
+
+static long ringPut (struct FujiRing *ring, const char *src, long len) {
+	long head = ring->head, done = 0;
+	const long avail = ringFree (ring);
+
+	if (len > avail) {
+		len = avail;
+	}
+	FUJI_RING_BARRIER ();
+	while (done < len) {
+		long chunk = ring->size - head;
+		if (chunk > len - done) {
+			chunk = len - done;
+		}
+		fujiCopy (src + done, ring->buffer + head, chunk);
+		done += chunk;
+		head += chunk;
+		if (head == ring->size) {
+			head = 0;
+		}
+	}
+	FUJI_RING_BARRIER ();
+	ring->head = head;
+	return done;
+}
+
+/* Copies up to len bytes out of the ring into dst, returning the count copied */
+
+static long ringGet (struct FujiRing *ring, char *dst, long len) {
+	long tail = ring->tail, done = 0;
+	const long avail = ringUsed (ring);
+
+	if (len > avail) {
+		len = avail;
+	}
+	FUJI_RING_BARRIER ();
+	while (done < len) {
+		long chunk = ring->size - tail;
+		if (chunk > len - done) {
+			chunk = len - done;
+		}
+		fujiCopy (ring->buffer + tail, dst + done, chunk);
+		done += chunk;
+		tail += chunk;
+		if (tail == ring->size) {
+			tail = 0;
+		}
+	}
+	FUJI_RING_BARRIER ();
+	ring->tail = tail;
+	return done;
+}
@@ -22,36 +22,69 @@
 #include "FujiDebugMacros.h"
 #include "FujiInterfaces.h"
 
-#define STANDALONE_FUJI_DRIVER 1 // Install a separate ".Fuji" driver
+#define STANDALONE_FUJI_DRIVER 1    // Install a separate ".Fuji" driver
+#define OUTPUT_RING_SIZE       2048 // Bytes of output the driver can queue, per port
+#define INPUT_RING_SIZE        1024 // Bytes of input the driver can hold, per port
+#define DEFAULT_PORT_WEIGHT    4    // Quanta per scheduler round
+#define DEFAULT_COALESCE_TICKS 0    // Send output as soon as the link is free
+#define DEFAULT_LONG_POLL_TICKS 30  // Longest the host may hold an idle poll
 
 #define FUJI_MAIN_RSRC "\p.FujiMain"
 #define FUJI_STUB_RSRC "\p.FujiStub"
 #define FUJI_STUB_HOFF 0x0022 // Offset to drvrHndl in stub driver
 
+static short disableInterrupts () {
+	short oldSR;
+	asm {
+		move.w sr, oldSR
+		ori.w  #0x0700, sr
+	}
+	return oldSR;
+}
+
+static void restoreInterrupts (short oldSR) {
+	asm {
+		move.w oldSR, sr
+	}
+}
+
 #if STANDALONE_FUJI_DRIVER
 
-	// Inside Macintosh: Devices: Listing 1-14
-	static short findSpaceInUnitTable () {
+	// Unit table we allocated, if any. Only this one is ours to free.
+	static Ptr ownedUTableBase = 0;
+
+	static short countFreeUnits () {
+		short unitNum, count = 0;
+		for (unitNum = UnitNtryCnt - 1; unitNum >= 48; unitNum--) {
+			if (GetDCtlEntry(~unitNum) == 0L) {
+				count++;
+			}
+		}
+		return count;
+	}
+
+	/* Makes sure there are at least "needed" free entries in the unit table,
+	 * so that a whole install can be done with at most one reallocation.
+	 * The table grows geometrically (Inside Macintosh: Devices, Listing 1-14
+	 * grows it by a fixed amount, which reallocates on every install).
+	 */
+	static OSErr reserveUnitTableSpace (short needed) {
 		Ptr   curUTableBase,    newUTableBase;
 		short curUTableEntries, newUTableEntries;
-		short refNum, unitNum;
+		short shortfall, oldSR;
+
+		shortfall = needed - countFreeUnits();
+		if (shortfall <= 0) {
+			return noErr;
+		}
 
 		// Get current unit table values from low memory globals
 		curUTableEntries = UnitNtryCnt;
 		curUTableBase    = (Ptr)UTableBase;
 
-		// Search for empty space in unit table
-		for (unitNum = curUTableEntries - 1; unitNum >= 48; unitNum--) {
-			refNum = ~(unitNum);
-			if (GetDCtlEntry(refNum) == 0L) {
-				return unitNum;
-			}
-		}
-
-		// no space in the current table, so make a new one
-
-		// increase the size of th table by 4 (an arbitrary value)
-		newUTableEntries = curUTableEntries + 4;
+		// Double the size of the table, or more if that is not enough
+		newUTableEntries = MAX (curUTableEntries * 2, curUTableEntries + shortfall);
+		newUTableEntries = MAX (newUTableEntries, 48 + needed);
 
 		// allocate space for the new table
 		newUTableBase = NewPtrSysClear ((long)newUTableEntries * sizeof(Handle));
@@ -59,15 +92,40 @@
 			return MemError();
 		}
 
-		// copy the old table to the new table
-		BlockMove (curUTableBase, newUTableBase, (long)curUTableEntries * sizeof(Handle));
+		// copy the old table to the new table and set the new unit table
+		// values in low memory, without letting an interrupt-time driver
+		// call see one without the other
 
-		// set the new unit table values in low memory
+		oldSR = disableInterrupts();
+		BlockMove (curUTableBase, newUTableBase, (long)curUTableEntries * sizeof(Handle));
 		UTableBase  = (unsigned long)newUTableBase;
 		UnitNtryCnt = newUTableEntries;
+		restoreInterrupts (oldSR);
 
-		unitNum = newUTableEntries - 1;
-		return unitNum;
+		// The table set up by the system may be referenced elsewhere, so
+		// only a table we allocated ourselves is released
+
+		if (curUTableBase == ownedUTableBase) {
+			DisposPtr (curUTableBase);
+		}
+		ownedUTableBase = newUTableBase;
+		return noErr;
+	}
+
+	static short findSpaceInUnitTable () {
+		short unitNum;
+		OSErr err = reserveUnitTableSpace (1);
+		if (err != noErr) {
+			return err;
+		}
+
+		// Search for empty space in unit table
+		for (unitNum = UnitNtryCnt - 1; unitNum >= 48; unitNum--) {
+			if (GetDCtlEntry(~unitNum) == 0L) {
+				return unitNum;
+			}
+		}
+		return openErr;
 	}
 #endif
 
@@ -102,16 +160,16 @@ static short findUnitNumberByName (ConstStr255Param drvrName) {
 }
 
 /**
- * Checks whether a particular driver has been replaced with a FujiNet driver,
+ * Checks whether a particular unit has been replaced with a FujiNet driver,
  * by looking for a magic number in the first long word of the driver storage.
  * If so, returns the driver storage.
  */
-static FujiSerDataHndl getSerialDataHndl (ConstStr255Param drvrName) {
+static FujiSerDataHndl getUnitDataHndl (short unitNumber) {
 	DCtlEntry  *dce;
 	DRVRHeader *header;
-	const short unitNumber = findUnitNumberByName(drvrName);
 	return (
-		(unitNumber != -1) &&
+		(unitNumber >= 0) &&
+		(unitNumber < UnitNtryCnt) &&
 		(getDCE(unitNumber, &dce, &header)) &&
 		(dce->dCtlFlags & dRAMBasedMask) &&
 		(dce->dCtlStorage != NULL) &&
@@ -119,12 +177,88 @@ static FujiSerDataHndl getSerialDataHndl (ConstStr255Param drvrName) {
 	   ) ? (FujiSerDataHndl)dce->dCtlStorage : NULL;
 }
 
+/**
+ * Looks up the unit number recorded for a driver name by installDCE
+ */
+static short getCachedUnitNumber (FujiSerDataHndl hndl, ConstStr255Param drvrName) {
+	short i;
+	for (i = 0; i < MAX_FUJI_UNITS; i++) {
+		if ((*hndl)->units[i].name[0] && EqualString (drvrName, (*hndl)->units[i].name, false, true)) {
+			return (*hndl)->units[i].unitNum;
+		}
+	}
+	return -1;
+}
+
+static void setCachedUnitNumber (FujiSerDataHndl hndl, ConstStr255Param drvrName, short unitNum) {
+	short i, slot = -1;
+	for (i = 0; i < MAX_FUJI_UNITS; i++) {
+		if ((*hndl)->units[i].name[0] == 0) {
+			if (slot == -1) slot = i;
+		} else if (EqualString (drvrName, (*hndl)->units[i].name, false, true)) {
+			slot = i;
+			break;
+		}
+	}
+	if (slot != -1 && drvrName[0] < sizeof(Str15)) {
+		BlockMove (drvrName, (*hndl)->units[slot].name, drvrName[0] + 1);
+		(*hndl)->units[slot].unitNum = unitNum;
+	}
+}
+
+/* Unit number of the main FujiNet driver as of the last lookup. Checked
+ * before each use, since other software may have changed the unit table.
+ */
+static short cachedFujiNum = -1;
+
 FujiSerDataHndl getFujiSerialDataHndl () {
-	#if STANDALONE_FUJI_DRIVER
-		return getSerialDataHndl (FUJI_DRVR_NAME);
-	#else
-		return getSerialDataHndl (MODEM_OUT_NAME);
+	FujiSerDataHndl hndl = getUnitDataHndl (cachedFujiNum);
+	if (hndl == NULL) {
+		#if STANDALONE_FUJI_DRIVER
+			cachedFujiNum = findUnitNumberByName (FUJI_DRVR_NAME);
+		#else
+			cachedFujiNum = findUnitNumberByName (MODEM_OUT_NAME);
+		#endif
+		hndl = getUnitDataHndl (cachedFujiNum);
+	}
+	return hndl;
+}
+
+/**
+ * Checks whether a particular driver has been replaced with a FujiNet driver.
+ * Only drivers installed through installDCE can share the FujiNet storage,
+ * so their unit numbers are looked up in the storage rather than by scanning
+ * the unit table.
+ */
+static FujiSerDataHndl getSerialDataHndl (ConstStr255Param drvrName) {
+	FujiSerDataHndl hndl = getFujiSerialDataHndl ();
+	return (
+		(hndl != NULL) &&
+		(getUnitDataHndl (getCachedUnitNumber (hndl, drvrName)) == hndl)
+	   ) ? hndl : NULL;
+}
+
+static void disposeFujiSerialDataHandle (FujiSerDataHndl hndl) {
+	short i;
+	for (i = 0; i < FUJI_NUM_PORTS; i++) {
+		if ((*hndl)->ports[i].outRing.buffer) {
+			DisposPtr ((*hndl)->ports[i].outRing.buffer);
+		}
+		if ((*hndl)->ports[i].inDefault) {
+			DisposPtr ((*hndl)->ports[i].inDefault);
+		}
+	}
+	#if USE_WRITE_BUFFER
+		for (i = 0; i < 2; i++) {
+			if ((*hndl)->writeData[i]) {
+				DisposPtr ((Ptr)(*hndl)->writeData[i]);
+			}
+		}
 	#endif
+	if ((*hndl)->drvrs) {
+		DisposPtr ((Ptr)(*hndl)->drvrs);
+	}
+	DisposHandle ((Handle)hndl);
 }
 
 /**
@@ -134,12 +268,73 @@ FujiSerDataHndl getFujiSerialDataHndl () {
 static FujiSerDataHndl newFujiSerialDataHandle () {
 	FujiSerDataHndl hndl = (FujiSerDataHndl) NewHandleSysClear(sizeof(struct FujiSerData));
 	if (hndl != NULL) {
+		short i;
+
+		// Allocate the output rings, which let writes complete without
+		// waiting on the link, and the input rings, which let each port's
+		// input be taken off the link without waiting on the other ports
+
+		for (i = 0; i < FUJI_NUM_PORTS; i++) {
+			Ptr outBuf = NewPtrSys (OUTPUT_RING_SIZE);
+			Ptr inBuf  = NewPtrSys (INPUT_RING_SIZE);
+			(*hndl)->ports[i].outRing.buffer = outBuf;
+			(*hndl)->ports[i].inDefault      = inBuf;
+			if (outBuf == NULL || inBuf == NULL) {
+				disposeFujiSerialDataHandle (hndl);
+				return NULL;
+			}
+			(*hndl)->ports[i].outRing.size   = OUTPUT_RING_SIZE;
+			(*hndl)->ports[i].inRing.buffer  = inBuf;
+			(*hndl)->ports[i].inRing.size    = INPUT_RING_SIZE;
+			(*hndl)->ports[i].inDefaultSize  = INPUT_RING_SIZE;
+			(*hndl)->ports[i].weight         = DEFAULT_PORT_WEIGHT;
+			(*hndl)->ports[i].coalesceTicks  = DEFAULT_COALESCE_TICKS;
+		}
+
+		(*hndl)->longPollLimit = DEFAULT_LONG_POLL_TICKS;
+
 		(*hndl)->id = 'FUJI';
 		fujiInit (&(*hndl)->conn);
 	}
 	return hndl;
 }
 
+/**
+ * Makes sure the driver registry has a slot for every unit in the unit
+ * table. The driver may register requests at interrupt time, so the copy
+ * and the swap are done with interrupts masked.
+ */
+static OSErr growDriverRegistry (FujiSerDataHndl hndl) {
+	struct DriverRegistry *oldReg = (*hndl)->drvrs;
+	struct DriverRegistry *newReg;
+	const short            count  = UnitNtryCnt;
+	short                  oldSR;
+
+	if (oldReg && oldReg->count >= count) {
+		return noErr;
+	}
+
+	newReg = (struct DriverRegistry *) NewPtrSysClear (DRIVER_REGISTRY_SIZE(count));
+	if (newReg == NULL) {
+		return MemError();
+	}
+	newReg->count   = count;
+	newReg->pending = (unsigned char *) &newReg->info[count];
+
+	oldSR = disableInterrupts();
+	if (oldReg) {
+		BlockMove (oldReg->info,    newReg->info,    (long)oldReg->count * sizeof(struct DriverInfo));
+		BlockMove (oldReg->pending, newReg->pending, (oldReg->count + 7) >> 3);
+	}
+	(*hndl)->drvrs = newReg;
+	restoreInterrupts (oldSR);
+
+	if (oldReg) {
+		DisposPtr ((Ptr)oldReg);
+	}
+	return noErr;
+}
+
 /**
  * Loads a named resource in the system heap.
  */
@@ -176,6 +371,14 @@ static OSErr installDCE (short unitNum, Handle drvrHdl, Handle drvrStorage) {
 	DCtlEntry  *dce;
 	Handle *table = (Handle*) UTableBase;
 
+	// The driver looks up suspended requests by unit number, so the
+	// registry must cover this unit before any request can reach it
+
+	OSErr err = growDriverRegistry ((FujiSerDataHndl)drvrStorage);
+	if (err) {
+		return err;
+	}
+
 	if (table[unitNum] == NULL) {
 		// Create the DCE
 		Handle dceHdl;
@@ -202,6 +405,8 @@ static OSErr installDCE (short unitNum, Handle drvrHdl, Handle drvrStorage) {
 	dce->dCtlDelay   = ((DRVRHeader*)*drvrHdl)->drvrDelay;
 	dce->dCtlDriver  = (Ptr) drvrHdl;
 	dce->dCtlStorage = drvrStorage;
+
+	setCachedUnitNumber ((FujiSerDataHndl)drvrStorage, ((DRVRHeader*)*drvrHdl)->drvrName, unitNum);
 	return noErr;
 }
 
@@ -319,6 +524,14 @@ OSErr fujiSerialInstall () {
 		}
 
 		#if STANDALONE_FUJI_DRIVER
+			// Reserve unit table entries for .Fuji and every driver we
+			// may later redirect, so the table is grown at most once
+
+			err = reserveUnitTableSpace (MAX_FUJI_UNITS);
+			if (err) {
+				goto error;
+			}
+
 			// Find space in the unit table
 
 			fujiNum = findSpaceInUnitTable();
@@ -338,8 +551,7 @@ OSErr fujiSerialInstall () {
 			if (err) {
 				goto error;
 			}
-
-			(*fujiData)->drvrInfo[0].refNum = ~fujiNum;
+			cachedFujiNum = fujiNum;
 		#else
 			// Install the main Fuji driver as the serial out driver
 
@@ -354,8 +566,7 @@ OSErr fujiSerialInstall () {
 			if (err) {
 				goto error;
 			}
-
-			(*fujiData)->drvrInfo[0].refNum = ~fujiNum;
+			cachedFujiNum = fujiNum;
 
 			// Install a stub driver as the serial in driver
 
@@ -369,7 +580,7 @@ error:
 		DisposHandle ((Handle)fujiHndl);
 	}
 	if (fujiData) {
-		DisposHandle ((Handle)fujiData);
+		disposeFujiSerialDataHandle (fujiData);
 	}
 	return err;
 }
@@ -420,6 +631,34 @@ Boolean fujiSerialStats (unsigned long *bytesRead, unsigned long *bytesWritten)
 	}
 }
 
+/**
+ * Allocates the write buffers, each with room for as many sectors as the
+ * host takes in one request, so that hosts and volumes which only take
+ * one sector at a time do not cost the system heap the room for more.
+ * This is only done for the first connection: once the driver is open the
+ * buffers may be on the bus at any time, so later connections keep them,
+ * and the driver sends no more sectors at a time than they hold.
+ */
+static OSErr newWriteBuffers (FujiSerDataHndl hndl) {
+	#if USE_WRITE_BUFFER
+		short i;
+
+		if ((*hndl)->writeExtent == 0) {
+			(*hndl)->writeExtent = (*hndl)->conn.extent;
+		}
+		for (i = 0; i < 2; i++) {
+			if ((*hndl)->writeData[i] == NULL) {
+				Ptr buf = NewPtrSysClear ((long)(*hndl)->writeExtent * sizeof(struct FujiWriteSector));
+				if (buf == NULL) {
+					return MemError();
+				}
+				(*hndl)->writeData[i] = (struct FujiWriteSector *) buf;
+			}
+		}
+	#endif
+	return noErr;
+}
+
 OSErr fujiSerialOpen (short vRefNum) {
 	OSErr err;
 	FujiSerDataHndl data;
@@ -435,9 +674,16 @@ OSErr fujiSerialOpen (short vRefNum) {
 	}
 	data = getFujiSerialDataHndl ();
 	if (data) {
+		short drvrRefNum;
 		HLock((Handle)data);
 		err = fujiOpen (&(*data)->conn, vRefNum);
+		if (err == noErr) {
+			err = newWriteBuffers (data);
+		}
 		HUnlock((Handle)data);
+		if (err == noErr) {
+			err = OpenDriver (FUJI_DRVR_NAME, &drvrRefNum);
+		}
 		return err;
 	} else {
 		#if DEBUG
@@ -28,12 +28,65 @@
 
 // Configuration options
 
-#define SANITY_CHECK      1 // Do additional error checking
+#define SANITY_CHECK  DEBUG // Do additional error checking in debug builds
 #define USE_AOUT_EXTRAS   0
 #define USE_IPP_UDP       0
 #define USE_IPP_TCP       0
+#define USE_PACKED_SECTORS 1 // Send packed sectors to hosts that accept them
+#define USE_WRITE_STATUS   1 // Skip reads when the host reports it has no data
+#define USE_DIRECT_WRITES  1 // Send large writes from the caller's buffer
+#define USE_DIRECT_READS   1 // Read into the caller's buffer when it has room
+#define USE_LONG_POLLS     1 // Let the host hold idle polls until it has input
+#define USE_QUEUED_WRITES  1 // Queue each write on the disk driver behind the last
+#define USE_RECOVERY       1 // Knock again to reconnect after an error
 
-#define VBL_TICKS         30 // Note, setting this to 15 can cause issues
+#if USE_DIRECT_WRITES && !USE_WRITE_STATUS
+	#error USE_DIRECT_WRITES needs USE_WRITE_STATUS to find hosts that read tags
+#endif
+
+// Poll scheduling: the VBL task polls every VBL_TICKS_MIN while there is
+// traffic on the link and doubles the interval on each idle poll, up to
+// VBL_TICKS_MAX.
+
+#define VBL_TICKS_MIN      1
+#define VBL_TICKS_MAX     30
+
+// Sector scheduling: ports with no more than INTERACTIVE_BYTES queued (such
+// as a terminal sending keystrokes) go ahead of the others; the rest share
+// the link in proportion to their weights, SCHED_QUANTUM bytes per unit.
+
+#define INTERACTIVE_BYTES 32
+#define SCHED_QUANTUM    125
+#define MAX_PORT_WEIGHT   32
+
+// Write coalescing: output that arrives while the link is busy may be held
+// back for up to MAX_COALESCE_TICKS, as set by FUJI_CTL_SET_COALESCE, so
+// that it goes out in fewer sectors.
+
+#define MAX_COALESCE_TICKS VBL_TICKS_MAX
+
+// Long polls: the most that FUJI_CTL_SET_LONG_POLL lets the host hold one,
+// and how many polls in a row at VBL_TICKS_MAX must find the link idle
+// before one is sent. Output that comes along while one is held waits for
+// it, so they are kept for when the Mac has gone quiet, not between the
+// keystrokes of someone typing.
+
+#define MAX_LONG_POLL_TICKS 120
+#define LONG_POLL_IDLE_POLLS  4
+
+// Recovery: after an error, the link knocks to reconnect at once, then
+// MIN_RECOVER_TICKS after each failed attempt, doubling up to
+// MAX_RECOVER_TICKS. Requests wait for it for up to MAX_STALL_TICKS before
+// failing with the error.
+
+#define MIN_RECOVER_TICKS  15
+#define MAX_RECOVER_TICKS 600
+#define MAX_STALL_TICKS   600
+
+// Opening: the first unit opened resets the link, waiting up to
+// MAX_OPEN_TICKS for a transfer still on the bus to finish.
+
+#define MAX_OPEN_TICKS     60
 
 // Menubar "led" indicators
 
@@ -163,6 +216,8 @@ void main() {
 }
 
 #include "LedIndicators.h" // Don't put this above main as it genererates code
+#include "FujiRingOps.h"   // Ditto
+#include "FujiFrameOps.h"  // Ditto
 
 /********** Completion and VBL Routines **********/
 
@@ -172,24 +227,58 @@ static VBLTask   *getVBLTask (void);
 static DCtlEntry *getMainDCE (void);
 
 static void schedVBLTask (void); // Schedule the VBL task to run ASAP
+static void schedVBLTaskIn (short ticks);
 
 // Completion routines
 
 static void complFlushOut (void);  // calls emptyWriteBufDone
 static void complReadIn (void);    // calls fillReadBufDone
+static void complDirectOut (void); // calls directWriteDone
+static void complDirectIn (void);  // calls directReadDone
+static void complRecover (void);   // calls recoverDone
 
 static void emptyWriteBufDone (IOParam *pb);
+static void directWriteDone  (IOParam *pb);
+static void directReadDone   (IOParam *pb);
 static void fillReadBufDone  (IOParam *pb);
+static void recoverDone      (IOParam *pb);
 static void fujiVBLTask   (VBLTask *vbl);
 
 // When I/O is done, dispatch to JIODone
 
 static void ioIsComplete (DCtlEntry *devCtlEnt, OSErr result);
 
-// Mutexes
+// Mutexes: the VBL mutex owns the bus (conn.iopb and the back buffers) for
+// the whole of an asynchronous transfer; the buffer mutex is only held for
+// short critical sections that touch the front buffers and swap indices.
 
 static Boolean    takeVblMutex (void);
 static void       releaseVblMutex (void);
+static Boolean    takeBufMutex (void);
+static void       releaseBufMutex (void);
+
+// Front buffers are the ones applications copy into and out of; back buffers
+// are the ones on, or waiting for, the bus. See FujiSerData. On the write
+// side, applications copy into the output ring of their port, which the
+// scheduler drains into the front write buffer one sector at a time.
+
+#define READ_FRONT(data)  (&(data)->readStorage[(data)->readIdx])
+#define READ_BACK(data)   (&(data)->readStorage[(data)->readIdx ^ 1])
+#define READ_PORT(data,i) ((data)->readData[i].dst - FUJI_PORT_MODEM)
+#define IS_PACKED(data,i) ((data)->readData[i].dst == FUJI_PORT_PACKED)
+#define WRITE_FRONT(data) (&(data)->writeStorage[(data)->writeIdx])
+#define WRITE_BACK(data)  (&(data)->writeStorage[(data)->writeIdx ^ 1])
+#define WRITE_SECTOR(data,k) (&(data)->writeData[(data)->writeIdx][k])
+
+// A read buffer is empty once everything in it has been copied out
+
+#define IS_EMPTY(storage) ((storage)->ioActCount == (storage)->ioReqCount)
+
+// The link has failed once conn.iopb holds an error. While a transfer is on
+// the bus its ioResult is ioInProgress, which is positive, so this holds for
+// errors only; requests must not take a transfer in flight for one.
+
+#define LINK_FAILED(data) ((data)->conn.iopb.ioResult < noErr)
 
 static void _vblRoutines (void) {
 	asm {
@@ -203,7 +292,7 @@ static void _vblRoutines (void) {
 			move.l   4(sp), (a0)+                      ; set dcePtr to devCtlPtr
 			lea      @callFujiVBL,a1                   ; address to entry
 			move.l   a1, VBLTask.vblAddr(a0)           ; update task address
-			move.w   #VBL_TICKS,VBLTask.vblCount(a0)   ; reset vblCount
+			move.w   #VBL_TICKS_MAX,VBLTask.vblCount(a0) ; reset vblCount
 			_VInstall
 		skipInstall:
 			rts
@@ -251,6 +340,18 @@ static void _vblRoutines (void) {
 			lea     fillReadBufDone,a1                    ; address of C function
 			bra.s   @callRoutineC
 
+		extern complDirectOut:
+			lea     directWriteDone,a1                    ; address of C function
+			bra.s   @callRoutineC
+
+		extern complDirectIn:
+			lea     directReadDone,a1                     ; address of C function
+			bra.s   @callRoutineC
+
+		extern complRecover:
+			lea     recoverDone,a1                        ; address of C function
+			bra.s   @callRoutineC
+
 		callFujiVBL:
 			lea     fujiVBLTask,a1                     ; address of C function
 			;bra.s   @callRoutineC
@@ -271,6 +372,10 @@ static void _vblRoutines (void) {
 			move.l  JIODone,-(sp)                      ; push IODone jump vector onto stack
 			rts
 
+		extern takeBufMutex:
+			moveq #1, d0
+			bra.s @takeMutex
+
 		extern takeVblMutex:
 			moveq #0, d0
 			;bra.s @takeMutex
@@ -281,6 +386,10 @@ static void _vblRoutines (void) {
 			seq d0
 			rts
 
+		extern releaseBufMutex:
+			moveq #1, d0
+			bra.s @releaseMutex
+
 		extern releaseVblMutex:
 			moveq #0, d0
 			;bra.s @releaseMutex
@@ -292,46 +401,793 @@ static void _vblRoutines (void) {
 	}
 }
 
-static struct DriverInfo *getDriverInfo (struct FujiSerData *data, short dCtlRefNum) {
-	struct DriverInfo *info;
-	for (info = data->drvrInfo; info->refNum; ++info) {
-		if (info->refNum == dCtlRefNum) {
+/* Makes the VBL task run within the given number of ticks, should it not
+ * be due before then. The VBL Manager may count down vblCount between the
+ * test and the store, which only makes the task run a tick late.
+ */
+
+static void schedVBLTaskIn (short ticks) {
+	VBLTask *vbl = getVBLTask();
+	if (vbl->vblCount > ticks) {
+		vbl->vblCount = MAX (ticks, VBL_TICKS_MIN);
+	}
+}
+
+/* Atomically set or clear a unit's bit in the pending bitmap. Since bset and
+ * bclr on memory operate on a byte, the bit number is taken modulo 8.
+ */
+
+static void setPendingBit (unsigned char *bits, short unitNum) {
+	asm {
+		movea.l bits, a0
+		move.w  unitNum, d0
+		move.w  d0, d1
+		lsr.w   #3, d1
+		bset    d0, (a0, d1.w)
+	}
+}
+
+static Boolean clearPendingBit (unsigned char *bits, short unitNum) {
+	Boolean wasSet;
+	asm {
+		movea.l bits, a0
+		move.w  unitNum, d0
+		move.w  d0, d1
+		lsr.w   #3, d1
+		bclr    d0, (a0, d1.w)
+		sne     wasSet
+	}
+	return wasSet;
+}
+
+/* Atomically takes a busy flag, returning false if it was already taken.
+ * As with the mutexes, bset is used rather than TAS, whose indivisible
+ * read-modify-write cycle not all Macintosh hardware supports; since the
+ * flags are only shared with interrupt code, an instruction that cannot
+ * be interrupted is all that is needed.
+ */
+
+static Boolean takeBusyFlag (unsigned char *flag) {
+	Boolean wasSet;
+	asm {
+		movea.l flag, a0
+		bset    #0, (a0)
+		sne     wasSet
+	}
+	return !wasSet;
+}
+
+static void releaseBusyFlag (unsigned char *flag) {
+	*flag = 0;
+}
+
+static void fillReadBuffer (struct FujiSerData *data);
+static void bufferCopy (struct StorageSpec *src, struct StorageSpec *dst);
+
+/* Must be called with the buffer mutex held. Once applications have drained
+ * the front read buffer, promotes a filled back buffer to the front, which
+ * frees the back buffer for the next read.
+ */
+
+static void swapReadBuffers (struct FujiSerData *data) {
+	if (IS_EMPTY (READ_FRONT (data)) && !IS_EMPTY (READ_BACK (data))) {
+		data->readIdx ^= 1;
+	}
+}
+
+/* Copy between a ring and a buffer described by a StorageSpec, advancing the
+ * StorageSpec's ioActCount by the number of bytes moved.
+ */
+
+static void ringFill (struct FujiRing *ring, struct StorageSpec *src) {
+	src->ioActCount += ringPut (ring, src->ioBuffer + src->ioActCount, src->ioReqCount - src->ioActCount);
+}
+
+static void ringDrain (struct FujiRing *ring, struct StorageSpec *dst) {
+	dst->ioActCount += ringGet (ring, dst->ioBuffer + dst->ioActCount, dst->ioReqCount - dst->ioActCount);
+}
+
+/* Maps a driver to the port it belongs to, as an index into data->ports:
+ *
+ * .AIn  (-6) or .AOut (-7) => FUJI_PORT_MODEM
+ * .BIn  (-8) or .BOut (-9) => FUJI_PORT_PRINTER
+ * otherwise                => FUJI_PORT_OTHER
+ */
+
+static short getPortIndex (short dCtlRefNum) {
+	short port = ((~dCtlRefNum) - 5) >> 1;
+	if (port < 0 || port > 1) port = 2;
+	return port;
+}
+
+/* Must be called with the buffer mutex held. Moves the records of a packed
+ * sector into the input rings of their ports, as far as they fit.
+ */
+
+static void unpackReadBuffer (struct FujiSerData *data, struct StorageSpec *buf) {
+	unsigned char *frame = (unsigned char *) buf->ioBuffer;
+
+	while (!frameAtEnd (frame, buf->ioActCount, buf->ioReqCount)) {
+		const unsigned char *rec = frame + buf->ioActCount;
+		const long           len = FUJI_RECORD_LENGTH (rec);
+		const long           n   = ringPut (&data->ports[FUJI_RECORD_PORT (rec) - FUJI_PORT_MODEM].inRing,
+		                                    (const char *) rec + FUJI_RECORD_HEADER_SIZE, len);
+
+		buf->ioActCount = frameConsume (frame, buf->ioActCount, n);
+		if (n < len) {
+			return;
+		}
+	}
+	buf->ioActCount = buf->ioReqCount; // Skip any padding
+}
+
+/* Must be called with the buffer mutex held. Moves sectors out of the read
+ * buffers and into the input ring of their port. This is done when the back
+ * buffer is needed for the next read, so that a port nobody is reading does
+ * not hold up the others, and when the application has supplied an input
+ * buffer with SerSetBuf, so that its input keeps flowing in the background.
+ * Otherwise a sector is left in place, to be copied straight to its reader.
+ * Packed sectors, which hold data for several ports, are always moved.
+ */
+
+static void demuxReadBuffers (struct FujiSerData *data) {
+	while (!IS_EMPTY (READ_FRONT (data))) {
+		if (IS_PACKED (data, data->readIdx)) {
+			unpackReadBuffer (data, READ_FRONT (data));
+			if (!IS_EMPTY (READ_FRONT (data))) {
+				break;
+			}
+		} else {
+			struct FujiPort *port = &data->ports[READ_PORT (data, data->readIdx)];
+			const Boolean    keep = IS_EMPTY (READ_BACK (data)) && (port->inRing.buffer == port->inDefault);
+
+			if (keep || ringFree (&port->inRing) == 0) {
+				break;
+			}
+			ringFill (&port->inRing, READ_FRONT (data));
+		}
+		swapReadBuffers (data);
+	}
+}
+
+/* Must be called with the buffer mutex held. Reads input for a port into an
+ * application's buffer: first what is in the port's ring, which is the
+ * oldest, then sectors for the port straight out of the read buffers.
+ * Sectors for other ports found on the way are moved to their own rings.
+ */
+
+static void readFromPort (struct FujiSerData *data, short portIdx, struct StorageSpec *buf) {
+	struct FujiRing *ring = &data->ports[portIdx].inRing;
+
+	for (;;) {
+		ringDrain (ring, buf);
+		if (ringUsed (ring) || buf->ioActCount == buf->ioReqCount) {
+			break;
+		}
+		swapReadBuffers (data);
+		if (IS_EMPTY (READ_FRONT (data))) {
 			break;
 		}
+		if (IS_PACKED (data, data->readIdx)) {
+			// Our ring was just drained, so if nothing could be unpacked
+			// it is another port's ring that is full
+			const long before = READ_FRONT (data)->ioActCount;
+			unpackReadBuffer (data, READ_FRONT (data));
+			if (READ_FRONT (data)->ioActCount == before) {
+				break;
+			}
+		} else if (READ_PORT (data, data->readIdx) == portIdx) {
+			bufferCopy (READ_FRONT (data), buf);
+		} else {
+			struct FujiRing *other = &data->ports[READ_PORT (data, data->readIdx)].inRing;
+			if (ringFree (other) == 0) {
+				break;
+			}
+			ringFill (other, READ_FRONT (data));
+		}
+	}
+	demuxReadBuffers (data);
+}
+
+/* Returns how much input for a port the driver holds: what is in its ring,
+ * plus its share of the read buffers.
+ */
+
+static long portBuffered (struct FujiSerData *data, short portIdx) {
+	long  count = ringUsed (&data->ports[portIdx].inRing);
+	short i;
+
+	for (i = 0; i < 2; i++) {
+		struct StorageSpec *storage = &data->readStorage[i];
+		if (IS_PACKED (data, i)) {
+			count += frameCount ((unsigned char *) storage->ioBuffer, storage->ioActCount, storage->ioReqCount, FUJI_PORT_MODEM + portIdx);
+		} else if (READ_PORT (data, i) == portIdx) {
+			count += storage->ioReqCount - storage->ioActCount;
+		}
+	}
+	return count;
+}
+
+/* Must be called with the buffer mutex held. Points a port's input ring at
+ * an application supplied buffer, or back at the driver's own if buffer is
+ * NULL or size is zero. As with the SCC driver, buffered input is discarded.
+ */
+
+static void setInputBuffer (struct FujiPort *port, Ptr buffer, long size) {
+	port->inRing.size   = 0;
+	port->inRing.head   = 0;
+	port->inRing.tail   = 0;
+	if (buffer == NULL || size <= 0) {
+		buffer = port->inDefault;
+		size   = port->inDefaultSize;
+	}
+	port->inRing.buffer = buffer;
+	port->inRing.size   = size;
+}
+
+/* Output less than a sector is held back until it has been queued for the
+ * port's coalescing delay, so that writes which follow each other closely
+ * share a sector. As with Nagle's algorithm, doPrime marks a write as due
+ * if the link is idle and no output is held back, since nothing would then
+ * be gained by waiting. Returns true if the port has output to send now.
+ */
+
+static Boolean portReady (struct FujiPort *port) {
+	const long queued = ringUsed (&port->outRing);
+	return queued && ((queued >= FUJI_PAYLOAD_SIZE) || (Ticks - port->coalesceFrom >= port->coalesceTicks));
+}
+
+/* Returns the number of ticks until output held back by portReady is due,
+ * or VBL_TICKS_MAX if there is none.
+ */
+
+static short coalesceDue (struct FujiSerData *data) {
+	short due = VBL_TICKS_MAX;
+	short i;
+	for (i = 0; i < FUJI_NUM_PORTS; i++) {
+		struct FujiPort *port = &data->ports[i];
+		if (ringUsed (&port->outRing) && !portReady (port)) {
+			due = MIN (due, (short) (port->coalesceTicks - (Ticks - port->coalesceFrom)));
+		}
+	}
+	return due;
+}
+
+static Boolean outputReady (struct FujiSerData *data) {
+	short i;
+	for (i = 0; i < FUJI_NUM_PORTS; i++) {
+		if (portReady (&data->ports[i])) {
+			return true;
+		}
 	}
-	// Not found, add to the list
-	info->refNum = dCtlRefNum;
-	return info;
+	return false;
+}
+
+static long outputQueued (struct FujiSerData *data) {
+	long  queued = 0;
+	short i;
+	for (i = 0; i < FUJI_NUM_PORTS; i++) {
+		queued += ringUsed (&data->ports[i].outRing);
+	}
+	return queued;
+}
+
+/* Must be called with the VBL mutex held. Picks the port whose output goes
+ * in the next sector, or returns -1 if there is none ready. A port with only
+ * a little output queued takes the interactive slot, which bounds keystroke
+ * latency to about one sector time however busy the other ports are. The
+ * other ports are served by deficit round robin.
+ */
+
+static short schedulePort (struct FujiSerData *data) {
+	struct FujiPort *port;
+	short i;
+
+	for (i = 0; i < FUJI_NUM_PORTS; i++) {
+		port = &data->ports[i];
+		if (ringUsed (&port->outRing) <= INTERACTIVE_BYTES && portReady (port)) {
+			return i;
+		}
+	}
+
+	for (i = 0; i < 2 * FUJI_NUM_PORTS; i++) {
+		port = &data->ports[data->schedPort];
+		if (!portReady (port)) {
+			port->deficit = 0;  // Idle ports do not save up their share
+		} else if (port->deficit > 0) {
+			return data->schedPort;
+		}
+
+		// Move on to the next port and give it its share for this round
+
+		if (++data->schedPort == FUJI_NUM_PORTS) {
+			data->schedPort = 0;
+		}
+		port = &data->ports[data->schedPort];
+		if (portReady (port)) {
+			port->deficit += (long)port->weight * SCHED_QUANTUM;
+		}
+	}
+	return -1;
+}
+
+#if USE_PACKED_SECTORS
+	/* Must be called with the buffer mutex held. Fills sector k of the front
+	 * write buffer with a packed sector: a record of up to n bytes from the
+	 * port picked by the scheduler, then whatever fits of the other ports'
+	 * output, taking no more than len bytes of data in all. The other ports
+	 * are charged for what they send, so it comes out of their next share.
+	 * Returns the size of the payload.
+	 */
+
+	static long packSector (struct FujiSerData *data, short k, short first, long n, long len) {
+		unsigned char *frame = (unsigned char *) WRITE_SECTOR (data, k)->payload;
+		long           used  = 0;
+		short          i     = first, j;
+
+		for (j = 0; j < FUJI_NUM_PORTS; j++) {
+			struct FujiPort *port = &data->ports[i];
+			const long       room = MIN (MIN (n, len), frameRoom (used, FUJI_PAYLOAD_SIZE));
+
+			if (room && ringUsed (&port->outRing)) {
+				const long got = ringGet (&port->outRing, (char *) frame + used + FUJI_RECORD_HEADER_SIZE, room);
+				frameAppend (frame, &used, FUJI_PORT_MODEM + i, got);
+				port->deficit -= got;
+				len           -= got;
+			}
+			n = len;
+			if (++i == FUJI_NUM_PORTS) {
+				i = 0;
+			}
+		}
+		WRITE_SECTOR (data, k)->src = FUJI_PORT_PACKED;
+		return used;
+	}
+#endif
+
+/* Must be called with the buffer mutex held. Fills sector k of the front
+ * write buffer with up to len bytes of output from the port picked by the
+ * scheduler. Returns the size of the payload, which is zero if there is no
+ * output to send.
+ */
+
+static long stageSector (struct FujiSerData *data, short k, long len) {
+	const short i      = schedulePort (data);
+	long        staged = 0;
+
+	if (i != -1) {
+		struct FujiPort *port = &data->ports[i];
+
+		// Ports in the interactive slot, or with the link to themselves,
+		// send everything they have; the others no more than what is
+		// left of their share
+		const long queued = ringUsed (&port->outRing);
+		const long total  = outputQueued (data);
+		const long n = (queued <= INTERACTIVE_BYTES || queued == total) ? len : MIN (len, port->deficit);
+
+		#if USE_PACKED_SECTORS
+			// Pack when the other ports' output would fit in what this
+			// port leaves of the sector
+			if (data->hostPacks && queued < total && MIN (n, queued) + 2 * FUJI_RECORD_HEADER_SIZE < len) {
+				staged = packSector (data, k, i, n, len);
+			} else
+		#endif
+		{
+			staged         = ringGet (&port->outRing, WRITE_SECTOR (data, k)->payload, n);
+			port->deficit -= staged;
+			WRITE_SECTOR (data, k)->src = FUJI_PORT_MODEM + i;
+		}
+		WRITE_SECTOR (data, k)->length = staged;
+		data->lastWritePort = i;
+	}
+	return staged;
+}
+
+/* Must be called with the VBL mutex held. If the back write buffer is free,
+ * or is on the bus with the front one free, and the buffer mutex is
+ * available, fills the front write buffer with as many sectors of output as
+ * the host takes in one request, then moves it to the back. Sectors are
+ * numbered as they are staged, so that one sent again after an error keeps
+ * its number. Returns true if there is a back buffer ready to send.
+ */
+
+static Boolean stageWriteBuffer (struct FujiSerData *data) {
+	struct StorageSpec *front = WRITE_FRONT (data);
+	Boolean             onBus = (data->writesOut != 0);
+
+	// Never stage more than the host has room for, less what is on its way
+	long credit = data->hostCredit;
+	if (onBus && (credit > 0)) {
+		credit -= MIN (credit, WRITE_BACK (data)->ioActCount);
+	}
+
+	#if USE_RECOVERY
+		// Output left in the front buffer by a failed write goes out again
+		// before anything newer, oldest first
+		if (!onBus && front->ioActCount && ((WRITE_BACK (data)->ioActCount == 0) ||
+		    FUJI_SEQ_DUPLICATE (WRITE_SECTOR (data, 0)->reserved, data->writeData[data->writeIdx ^ 1][0].reserved)) &&
+		    takeBufMutex()) {
+			data->writeIdx ^= 1;
+			front = WRITE_FRONT (data);
+			releaseBufMutex();
+		}
+	#endif
+
+	if (((WRITE_BACK (data)->ioActCount == 0) || (onBus && (front->ioActCount == 0))) && credit && takeBufMutex()) {
+		short k, n;
+		for (k = 0; k < data->writeExtent && credit; k++) {
+			const long staged = stageSector (data, k, (credit < 0) ? FUJI_PAYLOAD_SIZE : MIN (FUJI_PAYLOAD_SIZE, credit));
+			if (staged == 0) {
+				break;
+			}
+			front->ioActCount += staged;
+			if (credit > 0) {
+				credit -= MIN (credit, staged);
+			}
+		}
+		if (k) {
+			data->writeSectors[data->writeIdx] = k;
+			for (n = 0; n < k; n++) {
+				WRITE_SECTOR (data, n)->reserved = FUJI_SEQ (data->txSeq++);
+			}
+			data->writeIdx ^= 1;
+			onBus = false;
+		}
+		releaseBufMutex();
+	}
+	return !onBus && (WRITE_BACK (data)->ioActCount > 0);
+}
+
+/* Credit to advertise to the host: how much more input we can hold. The
+ * host does not know which port's ring its data will end up in, so only
+ * the space left in the fullest ring is counted.
+ */
+
+static long inputCredit (struct FujiSerData *data) {
+	long  ringSpace = ringFree (&data->ports[0].inRing);
+	short i;
+	for (i = 1; i < FUJI_NUM_PORTS; i++) {
+		ringSpace = MIN (ringSpace, ringFree (&data->ports[i].inRing));
+	}
+	return ringSpace +
+	       (NELEMENTS(data->readData[0].payload) - (READ_FRONT(data)->ioReqCount - READ_FRONT(data)->ioActCount)) +
+	       (NELEMENTS(data->readData[0].payload) - (READ_BACK(data)->ioReqCount  - READ_BACK(data)->ioActCount));
+}
+
+#if USE_DIRECT_READS
+	/* Called with the VBL mutex held. Reads a sector of input for the port
+	 * of the direct read, if any, straight into the application's buffer,
+	 * as described in "FujiLink.h". Should input for the port have reached
+	 * the driver by some other way since doPrime looked, the direct read is
+	 * given up, so that it is not overtaken. Returns true if a read was
+	 * started.
+	 */
+
+	static Boolean startDirectRead (struct FujiSerData *data) {
+		IOParam *pb = data->directReadPb;
+		Boolean  drained;
+
+		if (pb == NULL || !takeBufMutex()) {
+			return false;
+		}
+		drained = (portBuffered (data, data->directReadPort) == 0);
+		releaseBufMutex();
+		if (!drained) {
+			data->directReadPb = NULL;
+			return false;
+		}
+
+		data->conn.iopb.ioMisc        = (Ptr) data;
+		data->conn.iopb.ioBuffer      = pb->ioBuffer + pb->ioActCount;
+		data->conn.iopb.ioReqCount    = FUJI_SECTOR_SIZE;
+		data->conn.iopb.ioPosOffset  += FUJI_SECTOR_SIZE * (FUJI_PORT_MODEM + data->directReadPort);
+		data->conn.iopb.ioCompletion  = (IOCompletionUPP) complDirectIn;
+
+		data->directReadLast = true;
+		data->readDue        = false;
+		data->linkState      = LINK_READING;
+		VBL_READ_INDICATOR (LED_ASYNC_IO);
+		PBReadAsync ((ParmBlkPtr)&data->conn.iopb);
+		return true;
+	}
+#endif
+
+/* Called with the VBL mutex held. Polls the host for input. A direct read
+ * and the read buffers take turns, so that a reader waiting on one port
+ * does not keep the other ports from being polled. Returns true if a read
+ * was started.
+ */
+
+static Boolean startRead (struct FujiSerData *data) {
+	#if USE_DIRECT_READS
+		if (!data->directReadLast && startDirectRead (data)) {
+			return true;
+		}
+	#endif
+	if (IS_EMPTY (READ_BACK (data))) {
+		fillReadBuffer (data);
+		return true;
+	}
+	#if USE_DIRECT_READS
+		if (startDirectRead (data)) {
+			return true;
+		}
+	#endif
+	return false;
+}
+
+/* Called with the VBL mutex held. If the last reply told us the host has more
+ * than one sector of data and the back read buffer is free, fetch the next
+ * sector now rather than on the next VBL tick. Returns true if a read was
+ * started, in which case its completion routine becomes responsible for
+ * releasing the mutex.
+ */
+
+static Boolean readAheadIfDrained (struct FujiSerData *data) {
+	if (LINK_FAILED (data) || (data->readExtraAvail == 0)) {
+		return false;
+	}
+	#if USE_DIRECT_READS
+		// The rest of a port's input goes straight to its reader, if one
+		// is waiting with room for it
+		if ((data->readExtraPort == data->directReadPort) && startDirectRead (data)) {
+			return true;
+		}
+	#endif
+	if (IS_EMPTY (READ_BACK (data))) {
+		fillReadBuffer (data);
+		return true;
+	}
+	return false;
+}
+
+static void emptyWriteBuffer (struct FujiSerData *data);
+
+#if USE_DIRECT_WRITES
+	/* Called with the VBL mutex held. Sends as many whole sectors of the
+	 * direct write, if any, as the host takes in one request and has room
+	 * for, straight from the application's buffer. The header goes in the
+	 * tags, as described in "FujiLink.h". Returns true if a write was started.
+	 */
+
+	static Boolean startDirectWrite (struct FujiSerData *data) {
+		IOParam *pb = data->directPb;
+		long     sectors;
+
+		if (pb == NULL || WRITE_BACK (data)->ioActCount) {
+			return false;
+		}
+		sectors = MIN ((pb->ioReqCount - pb->ioActCount) / FUJI_SECTOR_SIZE, data->conn.extent);
+		if (data->hostCredit >= 0) {
+			sectors = MIN (sectors, data->hostCredit / FUJI_SECTOR_SIZE);
+		}
+		if (sectors <= 0) {
+			return false;
+		}
+
+		data->conn.iopb.ioMisc       = (Ptr) data;
+		data->conn.iopb.ioBuffer     = pb->ioBuffer + pb->ioActCount;
+		data->conn.iopb.ioReqCount   = sectors * FUJI_SECTOR_SIZE;
+		data->conn.iopb.ioCompletion = (IOCompletionUPP) complDirectOut;
+
+		FUJI_TAG_ID  = MAC_FUJI_REQUEST_TAG;
+		FUJI_TAG_SRC = ((FUJI_PORT_MODEM + data->directPort) << 8) | (USE_PACKED_SECTORS ? FUJI_PORT_PACKED : 0);
+		FUJI_TAG_LEN = FUJI_SECTOR_SIZE;
+		BufTgDate    = ((unsigned long) FUJI_CREDIT (inputCredit (data)) << 16) | FUJI_SEQ (data->txSeq);
+
+		data->directSeq  = data->txSeq;
+		data->txSeq     += sectors;
+		data->directLast = true;
+		data->linkState  = LINK_WRITING;
+		VBL_WRIT_INDICATOR (LED_ASYNC_IO);
+		PBWriteAsync ((ParmBlkPtr)&data->conn.iopb);
+		return true;
+	}
+#endif
+
+/* Called with the VBL mutex held while a write of the back write buffer is
+ * on the bus. Stages the front buffer and queues its write on the disk
+ * driver behind the one on the bus, which then starts on it as soon as the
+ * first is done, rather than after our completion routine has run and
+ * started it. Not done while the host has input for us or a direct write
+ * is waiting, since these would have to wait behind the queued write.
+ */
+
+static void queueWrite (struct FujiSerData *data) {
+	#if USE_QUEUED_WRITES
+		if ((data->writesOut == 1) && !LINK_FAILED (data) && !data->readDue &&
+		    (data->directPb == NULL) && stageWriteBuffer (data)) {
+			emptyWriteBuffer (data);
+			data->queuedStarts++;
+		}
+	#endif
+}
+
+/* Called with the VBL mutex held. Sends the next sectors of output, if there
+ * are any. A direct write and the output rings take turns, so that neither
+ * holds up the other. Returns true if a write was started.
+ */
+
+static Boolean startWrite (struct FujiSerData *data) {
+	#if USE_DIRECT_WRITES
+		if (!data->directLast && startDirectWrite (data)) {
+			return true;
+		}
+	#endif
+	if (stageWriteBuffer (data)) {
+		emptyWriteBuffer (data);
+		queueWrite (data);
+		return true;
+	}
+	#if USE_DIRECT_WRITES
+		if (startDirectWrite (data)) {
+			return true;
+		}
+	#endif
+	return false;
+}
+
+/* Returns true if a read is waiting in doPrime for more input */
+
+static Boolean readerWaiting (struct FujiSerData *data) {
+	struct DriverRegistry *reg = data->drvrs;
+	short unitNum;
+
+	for (unitNum = 0; unitNum < reg->count; unitNum++) {
+		IOParam *pendingPb = reg->info[unitNum].pendingPb;
+		if (pendingPb && (reg->pending[unitNum >> 3] & (1 << (unitNum & 7))) &&
+		    ((pendingPb->ioTrap & 0x00FF) == aRdCmd)) {
+			return true;
+		}
+	}
+	return false;
+}
+
+/* The link state machine. Called with the VBL mutex held whenever the bus
+ * is free: at the end of the wake-up that follows every transfer, and by
+ * the VBL task. Starts the next useful transfer, which is the first of:
+ *
+ *   1) a read, if the last write left the host with input for us
+ *   2) a write, if there is output the host has room for
+ *   3) a read-ahead, if the last read said the host has more
+ *   4) a poll, if a reader is waiting and the last read brought input
+ *
+ * Since each of these ends in another wake-up, the link keeps busy for as
+ * long as there is work, without waiting for the VBL task. A poll for a
+ * waiting reader only follows a read that brought input, so an idle host
+ * costs one empty read before the link goes back to the VBL task's polls.
+ * Returns true if a transfer was started.
+ */
+
+static Boolean linkNext (struct FujiSerData *data) {
+	if (LINK_FAILED (data)) {
+		return false;
+	}
+	if (data->readDue && startRead (data)) {
+		return true;
+	}
+	if (startWrite (data)) {
+		return true;
+	}
+	if (readAheadIfDrained (data)) {
+		return true;
+	}
+	return data->hostStreaming && readerWaiting (data) && startRead (data);
+}
+
+/* Called with the VBL mutex held, by the VBL task when the link is idle.
+ * Polls the host for input. Once polling has backed off all the way and
+ * stayed there for LONG_POLL_IDLE_POLLS polls, if the host takes long
+ * polls, holding them no longer than allowed, and no output would have to
+ * wait behind one, the poll is a long poll, which the host answers as soon
+ * as it has input. Output that comes along while one is held waits for it,
+ * so an application that is typing keeps the link on short polls. Returns
+ * true if a read was started.
+ */
+
+static Boolean startPoll (struct FujiSerData *data) {
+	#if USE_LONG_POLLS
+		if (data->conn.longPollTicks && (data->conn.longPollTicks <= data->longPollLimit) &&
+		    (data->vblCount == VBL_TICKS_MAX) && (data->idlePolls >= LONG_POLL_IDLE_POLLS) &&
+		    IS_EMPTY (READ_BACK (data)) && (outputQueued (data) == 0) && (data->directPb == NULL)) {
+			data->conn.iopb.ioPosOffset += FUJI_SECTOR_SIZE * FUJI_LONG_POLL_SECTOR;
+			data->longPollOut = true;
+			fillReadBuffer (data);
+			return true;
+		}
+	#endif
+	return startRead (data);
 }
 
 /* Wakes up all "FujiNet" drivers to give them a chance to complete queued I/O */
 
 static void wakeDriversAndReleaseMutex (struct FujiSerData *data) {
-	struct DriverInfo *info;
+	struct DriverRegistry *reg = data->drvrs;
+	const short            len = (reg->count + 7) >> 3;
+	short                  i, j;
+
+	#if USE_RECOVERY
+		if (LINK_FAILED (data) && !data->linkDown) {
+			// Start recovering on the next tick
+			data->linkDown    = true;
+			data->downSince   = Ticks;
+			data->recoverAt   = Ticks;
+			data->recoverWait = MIN_RECOVER_TICKS;
+			schedVBLTask();
+		}
+	#endif
 
-	data->inWakeUp = true;
-	for (info = data->drvrInfo; info->refNum; ++info) {
-		IOParam    *pb = info->pendingPb;
-		DCtlEntry *dce = info->pendingDce;
+	data->linkState = LINK_WAKING;
+	for (i = 0; i < len; i++) {
+		// Only visit the units that were pending on entry; doPrime may
+		// set their bits again to wait for the next wake-up
+		const unsigned char bits = reg->pending[i];
+		if (bits == 0) {
+			continue;
+		}
+		for (j = 0; j < 8; j++) {
+			const short unitNum = (i << 3) + j;
+			if ((bits & (1 << j)) && clearPendingBit (reg->pending, unitNum)) {
+				struct DriverInfo *info = &reg->info[unitNum];
+				IOParam    *pb = info->pendingPb;
+				DCtlEntry *dce = info->pendingDce;
+
+				// Clear pendingPb before doPrime, as it may set it to a new value
+				info->pendingPb = 0;
+
+				if (pb) {
+					const OSErr err = doPrime (pb, dce);
+					if (err != ioInProgress) {
+						ioIsComplete (dce, err);
+					}
+				}
+			}
+		}
+	}
+	if (data->writesOut) {
+		// A write queued behind the one that completed is on the bus, and
+		// its completion carries on from here
+		queueWrite (data);
+		data->linkState = LINK_WRITING;
+	} else if (linkNext (data)) {
+		data->chainedStarts++;
+	} else {
+		data->linkState = LINK_IDLE;
+		releaseVblMutex ();
+		schedVBLTaskIn (coalesceDue (data));
+	}
+}
 
-		// Clear pendingPb before doPrime, as it may set it to a new value
-		info->pendingPb = 0;
+/* Called by the read completion routines with the sequence number of a
+ * reply, as described in "FujiLink.h". Returns false if the reply is a
+ * duplicate of one already taken, which is then dropped.
+ */
 
-		if (pb) {
-			const OSErr err = doPrime (pb, dce);
-			if (err != ioInProgress) {
-				ioIsComplete (dce, err);
-			}
+static Boolean replyInSequence (struct FujiSerData *data, unsigned short seq) {
+	if (!FUJI_HAS_SEQ (seq)) {
+		return true;
+	}
+	if (data->rxSeq) {
+		if (FUJI_SEQ_DUPLICATE (seq, data->rxSeq)) {
+			data->seqDups++;
+			return false;
+		}
+		if (FUJI_SEQ_AHEAD (seq, data->rxSeq)) {
+			data->seqGaps++;
 		}
 	}
-	data->inWakeUp = false;
-	releaseVblMutex ();
+	data->rxSeq = FUJI_SEQ (seq + 1);
+	return true;
 }
 
 static void fillReadBuffer (struct FujiSerData *data) {
 	data->conn.iopb.ioMisc       = (Ptr) data;
-	data->conn.iopb.ioBuffer     = (Ptr) &data->readData;
+	data->conn.iopb.ioBuffer     = (Ptr) &data->readData[data->readIdx ^ 1];
+	data->conn.iopb.ioReqCount   = sizeof (data->readData[0]);
 	data->conn.iopb.ioCompletion = (IOCompletionUPP) complReadIn;
+	data->directReadLast         = false;
+	data->readDue                = false;
+	data->linkState              = LINK_READING;
 	VBL_READ_INDICATOR (LED_ASYNC_IO);
 	PBReadAsync ((ParmBlkPtr)&data->conn.iopb);
 }
@@ -340,121 +1196,541 @@ static void fillReadBufDone (IOParam *pb) {
 	struct FujiSerData *data = (struct FujiSerData *)pb->ioMisc;
 	long indicator = LED_ERROR;
 
+	#if USE_LONG_POLLS
+		if (data->longPollOut) {
+			pb->ioPosOffset  -= FUJI_SECTOR_SIZE * FUJI_LONG_POLL_SECTOR;
+			data->longPollOut = false;
+		}
+	#endif
+
+	data->hostStreaming = false;
 	if (pb->ioResult == noErr) {
+		const short         back    = data->readIdx ^ 1;
+		struct StorageSpec *storage = &data->readStorage[back];
+
+		if ((data->readData[back].id == MAC_FUJI_REPLY_TAG) && !replyInSequence (data, data->readData[back].reserved)) {
+			// Already taken; the back buffer stays empty
+			indicator = LED_IDLE;
+		}
+		else if (data->readData[back].id == MAC_FUJI_REPLY_TAG) {
+			const unsigned short avail  = data->readData[back].avail;
+			const unsigned short credit = data->readData[back].credit;
+
+			// The host reports how much it can accept as of this reply,
+			// which comes after all our earlier writes have been received
+			data->hostCredit = FUJI_HAS_CREDIT (credit) ? FUJI_CREDIT_BYTES (credit) : -1;
+
+			if (avail) {
+				data->linkActive    = true;
+				data->hostStreaming = true;
+			}
+
+			// Hosts without ports leave dst as zero; their replies go to
+			// the port we last wrote from
+
+			if (!IS_PACKED (data, back) && (data->readData[back].dst < FUJI_PORT_MODEM || data->readData[back].dst > FUJI_NUM_PORTS)) {
+				data->readData[back].dst = FUJI_PORT_MODEM + data->lastWritePort;
+			}
+			data->readExtraPort = READ_PORT (data, back);
+			data->hostPacks     = (data->readData[back].src == FUJI_PORT_PACKED);
 
-		if (data->readData.id == MAC_FUJI_REPLY_TAG) {
 			// The Pico will always report the total available bytes, even
 			// when the maximum message size is 500. Store the number of bytes
-			// in the read buffer in readLeft, with the overflow in readAvail.
+			// in the back buffer in its storage spec, with the overflow in
+			// readExtraAvail.
 
-			if (data->readData.avail > NELEMENTS(data->readData.payload)) {
-				data->readExtraAvail         = data->readData.avail - NELEMENTS(data->readData.payload);
-				data->readStorage.ioReqCount = NELEMENTS(data->readData.payload);
+			if (avail > NELEMENTS(data->readData[back].payload)) {
+				data->readExtraAvail = avail - NELEMENTS(data->readData[back].payload);
+				storage->ioReqCount  = NELEMENTS(data->readData[back].payload);
 			} else {
-				data->readStorage.ioReqCount = data->readData.avail;
-				data->readExtraAvail         = 0;
+				storage->ioReqCount  = avail;
+				data->readExtraAvail = 0;
+			}
+			storage->ioActCount = 0;
+
+			if (IS_PACKED (data, back) && !frameValid ((unsigned char *) storage->ioBuffer, storage->ioReqCount, FUJI_NUM_PORTS)) {
+				storage->ioActCount = storage->ioReqCount;
+				data->tagErrors++;
+				data->cumErrs |= framingErr;
+			}
+
+			// If an application is copying out of the front buffer, it will
+			// do the swap itself once the front buffer is drained
+
+			if (takeBufMutex()) {
+				swapReadBuffers (data);
+				demuxReadBuffers (data);
+				releaseBufMutex();
 			}
-			data->readStorage.ioActCount = 0;
 
 			indicator = LED_IDLE;
 		}
 		else {
 			indicator = LED_WRONG_TAG;
 			pb->ioResult = -1;
+			data->tagErrors++;
+			data->cumErrs |= framingErr;
 		}
+	} else {
+		data->ioErrors++;
+		data->cumErrs |= hwOverrunErr;
 	}
 	VBL_READ_INDICATOR (indicator);
 	wakeDriversAndReleaseMutex (data);
 }
 
-static void emptyWriteBuffer(struct FujiSerData *data) {
-	/* Figure out the source value:
-	 * -6 or -7  => 1
-	 * -8 or -9  => 2
-	 * otherwise => 3
-	 */
-	//short src = ((~devCtlEnt->dCtlRefNum) - 5) >> 1;
-	//if (src > 1) src = 3;
+/* Called after an asynchronous direct read has completed. The header of
+ * the reply is in the tags, and its data already in the application's
+ * buffer. Once the application has room for less than a sector, the rest
+ * of its read goes through the read buffers.
+ */
 
-	data->conn.iopb.ioMisc       = (Ptr) data;
-	data->conn.iopb.ioBuffer     = (Ptr) &data->writeData;
-	data->conn.iopb.ioCompletion = (IOCompletionUPP)complFlushOut;
+static void directReadDone (IOParam *pb) {
+	struct FujiSerData *data = (struct FujiSerData *)pb->ioMisc;
+	long indicator = LED_ERROR;
+
+	#if USE_DIRECT_READS
+		const short port = data->directReadPort;
+
+		pb->ioPosOffset -= FUJI_SECTOR_SIZE * (FUJI_PORT_MODEM + port);
+		data->hostStreaming = false;
+
+		if (pb->ioResult == noErr) {
+			if ((FUJI_TAG_ID == MAC_FUJI_REPLY_TAG) && ((FUJI_TAG_SRC & 0xFF) == FUJI_PORT_MODEM + port) &&
+			    !replyInSequence (data, BufTgDate & 0xFFFF)) {
+				// Already taken; the application's buffer is left as it was
+				indicator = LED_IDLE;
+			}
+			else if ((FUJI_TAG_ID == MAC_FUJI_REPLY_TAG) && ((FUJI_TAG_SRC & 0xFF) == FUJI_PORT_MODEM + port)) {
+				IOParam             *app    = data->directReadPb;
+				const unsigned short avail  = FUJI_TAG_LEN;
+				const unsigned short credit = BufTgDate >> 16;
+				const long           n      = MIN (avail, FUJI_SECTOR_SIZE);
+
+				data->hostCredit     = FUJI_HAS_CREDIT (credit) ? FUJI_CREDIT_BYTES (credit) : -1;
+				data->hostPacks      = ((FUJI_TAG_SRC >> 8) == FUJI_PORT_PACKED);
+				data->readExtraAvail = avail - n;
+				data->readExtraPort  = port;
+				if (avail) {
+					data->linkActive    = true;
+					data->hostStreaming = true;
+				}
+
+				app->ioActCount += n;
+				if (app->ioReqCount - app->ioActCount < FUJI_SECTOR_SIZE) {
+					data->directReadPb = NULL;
+				}
+				indicator = LED_IDLE;
+			}
+			else {
+				indicator = LED_WRONG_TAG;
+				pb->ioResult = -1;
+				data->tagErrors++;
+				data->cumErrs |= framingErr;
+			}
+		} else {
+			data->ioErrors++;
+			data->cumErrs |= hwOverrunErr;
+		}
+	#endif
+	VBL_READ_INDICATOR (indicator);
+	wakeDriversAndReleaseMutex (data);
+}
+
+/* Sends the back write buffer with its own parameter block, which is set up
+ * to address the magic sector like conn.iopb; call stageWriteBuffer first.
+ */
+
+static void emptyWriteBuffer(struct FujiSerData *data) {
+	const short          back   = data->writeIdx ^ 1;
+	const unsigned short credit = FUJI_CREDIT (inputCredit (data));
+	IOParam             *pb     = &data->writePb[back];
+	short                k;
+
+	pb->ioMisc       = (Ptr) data;
+	pb->ioRefNum     = data->conn.iopb.ioRefNum;
+	pb->ioVRefNum    = data->conn.iopb.ioVRefNum;
+	pb->ioPosMode    = data->conn.iopb.ioPosMode;
+	pb->ioPosOffset  = data->conn.iopb.ioPosOffset;
+	pb->ioBuffer     = (Ptr) &data->writeData[back][0];
+	pb->ioReqCount   = data->writeSectors[back] * sizeof (data->writeData[back][0]);
+	pb->ioCompletion = (IOCompletionUPP)complFlushOut;
+
+	// src and length are set by stageSector, and reserved by stageWriteBuffer
+
+	for (k = 0; k < data->writeSectors[back]; k++) {
+		data->writeData[back][k].id       = MAC_FUJI_REQUEST_TAG;
+		data->writeData[back][k].dst      = USE_PACKED_SECTORS ? FUJI_PORT_PACKED : 0;
+		data->writeData[back][k].credit   = credit;
+	}
 
-	data->writeData.id           = MAC_FUJI_REQUEST_TAG;
-	data->writeData.src          = 0;
-	data->writeData.dst          = 0;
-	data->writeData.reserved     = 0;
-	data->writeData.length       = data->writeStorage.ioActCount;
+	// Clear the tags, which frame direct writes only. Hosts that report
+	// their status on writes replace them; a write queued behind another
+	// may go out with that status in its tags, which hosts tell apart
+	// from a direct write by the id.
+	FUJI_TAG_ID = 0;
+	BufTgDate   = 0;
 
+	data->writesOut++;
+	data->directLast = false;
+	data->linkState  = LINK_WRITING;
 	VBL_WRIT_INDICATOR (LED_ASYNC_IO);
-	PBWriteAsync ((ParmBlkPtr)&data->conn.iopb);
+	PBWriteAsync ((ParmBlkPtr)pb);
 }
 
-/* Called after an asynchronous write to the FujiNet device has completed */
+/* Called once the write of sent bytes of output in pb has completed,
+ * whichever way it was framed.
+ */
 
-static void emptyWriteBufDone (IOParam *pb) {
-	struct FujiSerData *data = (struct FujiSerData *)pb->ioMisc;
+static void writeDone (struct FujiSerData *data, IOParam *pb, long sent) {
 	long wrIndicator = LED_ERROR;
 
 	if (pb->ioResult == noErr) {
-		data->writeStorage.ioActCount = 0;
-		wrIndicator                   = LED_IDLE;
+		Boolean hostHasData = true;
 
-		if (data->readStorage.ioActCount == data->readStorage.ioReqCount) {
-			VBL_WRIT_INDICATOR (wrIndicator);
-
-			// After writing data, immediately do a read if the buffer is empty
-			fillReadBuffer (data);
-			return;
+		if (data->hostCredit > 0) {
+			data->hostCredit -= MIN (data->hostCredit, sent);
 		}
+		data->linkActive = true;
+		wrIndicator      = LED_IDLE;
+
+		#if USE_WRITE_STATUS
+			if ((FUJI_TAG_ID == MAC_FUJI_REPLY_TAG) && (BufTgDate == FUJI_STATUS_TAG)) {
+				// The status is as of after this write, so it replaces
+				// what we worked out above
+				data->hostCredit = FUJI_HAS_CREDIT (BufTgFFlag) ? FUJI_CREDIT_BYTES (BufTgFFlag) : -1;
+				data->hostTags   = true;
+				hostHasData      = BufTgFBkNum != 0;
+				if (!hostHasData) {
+					data->readExtraAvail = 0;
+				}
+			}
+		#endif
+
+		// linkNext reads next, unless the host said it has nothing for us
+		data->readDue = hostHasData;
 	} // pb->ioResult == noErr
+	else {
+		data->ioErrors++;
+		data->cumErrs |= hwOverrunErr;
+	}
 
 	VBL_WRIT_INDICATOR (wrIndicator);
 	wakeDriversAndReleaseMutex (data);
 }
 
-/* Main VBL Task for the FujiNet serial driver. This task must run periodically
- * to:
+/* Called after an asynchronous write of a write buffer has completed. This
+ * is the back buffer, unless a write of it was queued behind this one.
+ */
+
+static void emptyWriteBufDone (IOParam *pb) {
+	struct FujiSerData *data    = (struct FujiSerData *)pb->ioMisc;
+	struct StorageSpec *storage = &data->writeStorage[(pb == &data->writePb[0]) ? 0 : 1];
+	const long          sent    = storage->ioActCount;
+
+	data->writesOut--;
+	if (LINK_FAILED (data)) {
+		// A write queued behind one that failed is sent again after it,
+		// even if it got through, since the host drops sectors that come
+		// ahead of missing ones
+	} else if (pb->ioResult == noErr) {
+		storage->ioActCount = 0;
+	} else {
+		// Errors stop the link until it recovers, as do those on conn.iopb;
+		// the output stays in the buffer to be sent again
+		data->conn.iopb.ioResult = pb->ioResult;
+	}
+	writeDone (data, pb, sent);
+}
+
+/* Called after an asynchronous direct write has completed. Once less than a
+ * sector of the application's data is left, the rest goes through the
+ * output ring like any other write. A write that failed is sent again from
+ * the same place once the link is back, with the same numbers, so that the
+ * host drops whatever of it did get through.
+ */
+
+static void directWriteDone (IOParam *pb) {
+	struct FujiSerData *data = (struct FujiSerData *)pb->ioMisc;
+
+	#if USE_DIRECT_WRITES
+		if (pb->ioResult == noErr) {
+			IOParam *app = data->directPb;
+
+			app->ioActCount += pb->ioReqCount;
+			if (app->ioReqCount - app->ioActCount < FUJI_SECTOR_SIZE) {
+				data->directPb = NULL;
+			}
+		} else {
+			data->txSeq = data->directSeq;
+		}
+	#endif
+	writeDone (data, pb, pb->ioReqCount);
+}
+
+#if USE_RECOVERY
+	// Starts the transfer of an attempt to reconnect given by recoverStep
+
+	static void recoverNext (struct FujiSerData *data) {
+		const char  knockSeq[] = MAC_FUJI_KNOCK_SEQ;
+		IOParam    *pb         = &data->recoverPb;
+		const short step       = data->recoverStep;
+		short       i;
+
+		if (step < MAC_FUJI_KNOCK_LEN) {
+			pb->ioPosOffset = FUJI_SECTOR_SIZE * (long) knockSeq[step];
+			PBReadAsync ((ParmBlkPtr)pb);
+		} else if (step < MAC_FUJI_KNOCK_LEN + data->conn.extent) {
+			for (i = 0; i < NELEMENTS(data->recoverSector); i++) {
+				data->recoverSector[i] = MAC_FUJI_REQUEST_TAG;
+			}
+			// The first sector, which tells the host where the others
+			// are, goes last, as in fujiOpen
+			pb->ioPosOffset = data->conn.iopb.ioPosOffset +
+			                  FUJI_SECTOR_SIZE * ((step - MAC_FUJI_KNOCK_LEN + 1) % data->conn.extent);
+
+			// Clear the tags, so that the host does not take these
+			// for direct writes
+			FUJI_TAG_ID = 0;
+			BufTgDate   = 0;
+			PBWriteAsync ((ParmBlkPtr)pb);
+		} else {
+			pb->ioPosOffset = data->conn.iopb.ioPosOffset;
+			PBReadAsync ((ParmBlkPtr)pb);
+		}
+	}
+
+	/* Called with the VBL mutex held, by the VBL task once the link has
+	 * failed and an attempt to reconnect is due. Does again what fujiOpen
+	 * did to connect: knocks, then writes the magic sectors and reads back
+	 * the first to check that the host still has it where we do. This is
+	 * done at the level of the disk driver, with recoverPb, so that
+	 * conn.iopb keeps the error until the link is back. The transfers are
+	 * started one after the other by recoverDone.
+	 */
+
+	static void startRecovery (struct FujiSerData *data) {
+		IOParam *pb = &data->recoverPb;
+
+		pb->ioMisc       = (Ptr) data;
+		pb->ioRefNum     = data->conn.iopb.ioRefNum;
+		pb->ioVRefNum    = data->conn.iopb.ioVRefNum;
+		pb->ioPosMode    = data->conn.iopb.ioPosMode;
+		pb->ioBuffer     = (Ptr) data->recoverSector;
+		pb->ioReqCount   = FUJI_SECTOR_SIZE;
+		pb->ioCompletion = (IOCompletionUPP) complRecover;
+
+		data->recoverStep = 0;
+		data->linkState   = LINK_RECOVERING;
+		VBL_WRIT_INDICATOR (LED_BLKED_IO);
+		recoverNext (data);
+	}
+
+	/* Called once an attempt has reconnected. The link starts over as it
+	 * does when the driver is opened, with a read to learn how much the host
+	 * can take. Output that was being written when the link failed is kept,
+	 * along with any queued behind it, and goes first, oldest first, with
+	 * its old sequence numbers, so that the host drops whatever of it did
+	 * get through and takes the rest in order. This goes for a direct write
+	 * too, which stays direct; reads that were waiting in doPrime are
+	 * looked at afresh, and may go direct again.
+	 */
+
+	static void linkRecovered (struct FujiSerData *data) {
+		data->recoveries++;
+		data->downTicks  += Ticks - data->downSince;
+		data->linkDown    = false;
+
+		data->readDue        = true;
+		data->hostStreaming  = false;
+		data->readExtraAvail = 0;
+		data->hostCredit     = 0;
+		data->hostPacks      = false;
+		data->hostTags       = false;
+
+		data->directLast     = false;
+		data->directReadPb   = NULL;
+		data->directReadLast = false;
+
+		data->rxSeq = 0;
+
+		data->linkActive         = true;
+		data->conn.iopb.ioResult = noErr;
+		VBL_WRIT_INDICATOR (LED_IDLE);
+		VBL_READ_INDICATOR (LED_IDLE);
+	}
+#endif
+
+/* Called after each transfer of an attempt to reconnect. On failure, the
+ * next attempt waits twice as long as this one did.
+ */
+
+static void recoverDone (IOParam *pb) {
+	struct FujiSerData *data = (struct FujiSerData *)pb->ioMisc;
+
+	#if USE_RECOVERY
+		const short last = MAC_FUJI_KNOCK_LEN + data->conn.extent;
+		OSErr       err  = pb->ioResult;
+
+		// Did the knock get a FujiNet reply, and is the magic sector still
+		// where it was?
+		if ((err == noErr) && (data->recoverStep == MAC_FUJI_KNOCK_LEN - 1) && (BufTgFNum != MAC_FUJI_REPLY_TAG)) {
+			err = -1;
+		}
+		if ((err == noErr) && (data->recoverStep == last) &&
+		    ((data->recoverSector[0] != MAC_FUJI_REPLY_TAG) ||
+		     (data->recoverSector[1] != data->conn.iopb.ioPosOffset / FUJI_SECTOR_SIZE))) {
+			err = -1;
+		}
+
+		if ((err == noErr) && (data->recoverStep < last)) {
+			data->recoverStep++;
+			recoverNext (data);
+			return;
+		}
+		if (err == noErr) {
+			linkRecovered (data);
+		} else {
+			data->recoverFails++;
+			data->recoverAt   = Ticks + data->recoverWait;
+			data->recoverWait = MIN (data->recoverWait * 2, MAX_RECOVER_TICKS);
+			VBL_WRIT_INDICATOR (LED_ERROR);
+		}
+	#endif
+	wakeDriversAndReleaseMutex (data);
+}
+
+/* Picks the number of ticks until the next poll. While there is traffic on the
+ * link, or data known to be waiting on either side, poll on every tick; once
+ * the link goes quiet, back off exponentially up to VBL_TICKS_MAX.
+ */
+
+static unsigned char nextPollInterval (struct FujiSerData *data) {
+	unsigned char ticks = data->vblCount;
+
+	// Output the host has no room for is not traffic; polls at the backed
+	// off rate will pick up new credit. Nor is output held back to be
+	// coalesced, which gets the task run when it is due.
+	if (data->linkActive || data->readExtraAvail || ((outputReady (data) || data->directPb) && data->hostCredit)) {
+		ticks           = VBL_TICKS_MIN;
+		data->idlePolls = 0;
+	} else if (ticks < VBL_TICKS_MAX / 2) {
+		ticks <<= 1;
+	} else {
+		if ((ticks == VBL_TICKS_MAX) && (data->idlePolls < LONG_POLL_IDLE_POLLS)) {
+			data->idlePolls++;
+		}
+		ticks = VBL_TICKS_MAX;
+	}
+	data->linkActive = false;
+	return ticks;
+}
+
+/* Main VBL Task for the FujiNet serial driver. While there is work, each
+ * transfer is started by linkNext as the one before it completes, so this
+ * task is a watchdog for when the link has gone idle. It must run
+ * periodically to:
  *
- *   1) check for outgoing data that needs to be written to the FujiNet device
- *   2) poll for incoming data once the read buffer is exhausted
+ *   1) restart the link when new output or input is waiting
+ *   2) otherwise poll for incoming data, as the host cannot interrupt us
  *   3) wake up FujiNet drivers to process queued I/O
+ *   4) reconnect after an error, see startRecovery
+ *
+ * The task reloads vblCount exactly once per run, after it knows whether it
+ * got the mutex. If a transfer or wake-up still holds the mutex, it retries
+ * on the next tick rather than sleeping for a whole interval; reloading the
+ * count on entry used to let a busy mutex push the next poll out by a full
+ * interval, which is what made short fixed intervals misbehave.
  */
 
 static void fujiVBLTask (VBLTask *vbl) {
 	const DCtlEntry *devCtlEnt = getMainDCE();
 	struct FujiSerData *data = *(FujiSerDataHndl)devCtlEnt->dCtlStorage;
 
-	vbl->vblCount    = data->vblCount;
+	if (!takeVblMutex()) {
+		vbl->vblCount = VBL_TICKS_MIN;
+		return;
+	}
 
-	if (takeVblMutex()) {
-		if (data->conn.iopb.ioResult == noErr) {
-			if (data->writeStorage.ioActCount > 0) {
-				emptyWriteBuffer(data);
-				return;
-			}
-			else if (data->readStorage.ioActCount == data->readStorage.ioReqCount) {
-				fillReadBuffer (data);
-				return;
-			}
-		} // data->conn.iopb.ioResult == noErr
+	data->vblCount = nextPollInterval (data);
+	vbl->vblCount  = data->vblCount;
+
+	#if USE_RECOVERY
+		if (data->linkDown && ((long) (Ticks - data->recoverAt) >= 0)) {
+			startRecovery (data);
+			return;
+		}
+	#endif
 
-		wakeDriversAndReleaseMutex (data);
-	} // takeVblMutex
+	if (linkNext (data) || (!LINK_FAILED (data) && startPoll (data))) {
+		data->vblStarts++;
+		return;
+	}
+
+	wakeDriversAndReleaseMutex (data);
 }
 
 /********** Device driver routines **********/
 
 static OSErr doControl (CntrlParam *pb, DCtlEntry *devCtlEnt) {
-	//struct FujiSerData *data = *(FujiSerDataHndl)devCtlEnt->dCtlStorage;
+	struct FujiSerData *data = *(FujiSerDataHndl)devCtlEnt->dCtlStorage;
+
+	if (pb->csCode == 9) {
+		// .AIn SerSetBuf: Use an application supplied input buffer for
+		// this port, or restore the default one if the size is zero
+
+		struct FujiPort *port = &data->ports[getPortIndex (devCtlEnt->dCtlRefNum)];
+
+		if (!takeBusyFlag (&port->inBusy)) {
+			return portInUse;
+		}
+		if (!takeBufMutex()) {
+			releaseBusyFlag (&port->inBusy);
+			return portInUse;
+		}
+		setInputBuffer (port, *(Ptr*) &pb->csParam[0], pb->csParam[2]);
+		demuxReadBuffers (data);
+		releaseBufMutex();
+		releaseBusyFlag (&port->inBusy);
+	}
+	else if (pb->csCode == FUJI_CTL_SET_WEIGHT) {
+		// Sets the share of the link given to a port's output
+
+		const short port   = pb->csParam[0];
+		const short weight = pb->csParam[1];
+
+		if (port < FUJI_PORT_MODEM || port > FUJI_NUM_PORTS || weight < 1 || weight > MAX_PORT_WEIGHT) {
+			return paramErr;
+		}
+		data->ports[port - FUJI_PORT_MODEM].weight = weight;
+	}
+	else if (pb->csCode == FUJI_CTL_SET_COALESCE) {
+		// Sets how long a port's output may be held back so that more can
+		// join it in a sector: zero for interactive use, more for bulk
+
+		const short port  = pb->csParam[0];
+		const short ticks = pb->csParam[1];
 
+		if (port < FUJI_PORT_MODEM || port > FUJI_NUM_PORTS || ticks < 0 || ticks > MAX_COALESCE_TICKS) {
+			return paramErr;
+		}
+		data->ports[port - FUJI_PORT_MODEM].coalesceTicks = ticks;
+	}
+	else if (pb->csCode == FUJI_CTL_SET_LONG_POLL) {
+		// Sets the longest the host may hold an idle poll, during which
+		// output must wait; zero turns long polls off
+
+		const short ticks = pb->csParam[0];
+
+		if (ticks < 0 || ticks > MAX_LONG_POLL_TICKS) {
+			return paramErr;
+		}
+		data->longPollLimit = ticks;
+	}
 	#if USE_AOUT_EXTRAS
-		if (pb->csCode == 8) {
+		else if (pb->csCode == 8) {
 			// .AOut SerReset: Reset serial port drivers and configure the port
 		}
-		else if (pb->csCode == 9) {
-			// .AOut SerSetBuf: Increase or restore size of serial input buffer
-		}
 		else if (pb->csCode == 10) {
 			// .AOut SerHShake: Set handshaking options
 		}
@@ -597,24 +1873,51 @@ static OSErr doStatus (CntrlParam *pb, DCtlEntry *devCtlEnt) {
 
 		// SetGetBuff: Return how much data is available
 
+		const short portIdx = getPortIndex (devCtlEnt->dCtlRefNum);
+		long        avail   = portBuffered (data, portIdx);
+
+		if (data->readExtraPort == portIdx) {
+			avail += data->readExtraAvail;
+		}
 		pb->csParam[0] = 0; // High order-word
-		pb->csParam[1] = (data->readStorage.ioReqCount - data->readStorage.ioActCount) + data->readExtraAvail;
+		pb->csParam[1] = avail;
+	}
+	else if (pb->csCode == 8) {
+
+		// SerStatus: Obtain status information from the serial driver.
+		// There is no XOn/XOff on the FujiNet link, so the flow control
+		// fields report its equivalents: xOffSent when no more input will
+		// be read until applications drain it, xOffHold when the port's
+		// output ring is full, and ctsHold when the FujiNet is not responding.
+		// Like these, rdPend and wrPend are for the caller's port only, so
+		// they count the requests waiting on either of its drivers.
+
+		SerStaRec *status = (SerStaRec *) &pb->csParam[0];
+		struct DriverRegistry *reg = data->drvrs;
+		const short portIdx = getPortIndex (devCtlEnt->dCtlRefNum);
+		short unitNum;
+
+		status->rdPend = 0;
+		status->wrPend = 0;
+		for (unitNum = 0; unitNum < reg->count; unitNum++) {
+			IOParam *pendingPb = reg->info[unitNum].pendingPb;
+			if (pendingPb && (reg->pending[unitNum >> 3] & (1 << (unitNum & 7))) &&
+			    (getPortIndex (~unitNum) == portIdx)) {
+				if ((pendingPb->ioTrap & 0x00FF) == aRdCmd) {
+					status->rdPend = 0xFF;
+				} else {
+					status->wrPend = 0xFF;
+				}
+			}
+		}
+		status->cumErrs  = data->cumErrs;
+		status->xOffSent = IS_EMPTY (READ_BACK (data)) ? 0 : xOffWasSent;
+		status->xOffHold = ringFree (&data->ports[portIdx].outRing) ? 0 : 0xFF;
+		status->ctsHold  = LINK_FAILED (data) ? 0xFF : 0;
+		data->cumErrs    = 0;
 	}
 	#if USE_AOUT_EXTRAS
-		else if (pb->csCode == 8) {
-
-			// SerStatus: Obtain status information from the serial driver
-
-			SerStaRec *status = (SerStaRec *) &pb->csParam[0];
-			status->rdPend  = 0;
-			status->wrPend  = 0;
-			status->ctsHold = 0;
-			status->cumErrs = 0;
-			status->cumErrs  = 0;
-			status->xOffSent = 0;
-			status->xOffHold = 0;
-
-		} else if (pb->csCode == 9) {
+		else if (pb->csCode == 9) {
 			// .AOut Serial Driver Version
 		}
 	#endif
@@ -672,7 +1975,7 @@ static void bufferCopy (struct StorageSpec *src, struct StorageSpec *dst) {
 	#endif
 
 	if (dstLeft > 0) {
-		BlockMove (
+		fujiCopy (
 			src->ioBuffer + src->ioActCount,
 			dst->ioBuffer + dst->ioActCount,
 			dstLeft
@@ -682,55 +1985,227 @@ static void bufferCopy (struct StorageSpec *src, struct StorageSpec *dst) {
 	dst->ioActCount += dstLeft;
 }
 
+/* Must be called with the port's inBusy flag held. Fills a read from the
+ * port's input ring, which needs no mutex since the holder of inBusy is its
+ * only consumer, and then, if that was not enough, from the read buffers.
+ */
+
+static void primeRead (struct FujiSerData *data, IOParam *pb, short portIdx) {
+	struct StorageSpec *buf = (struct StorageSpec*) &pb->ioBuffer;
+
+	#if USE_DIRECT_READS
+		// doPrime only sees a direct read again during a wake-up, when it
+		// is off the bus, so it takes whatever input has reached the
+		// driver first and is then looked at afresh
+		if (data->directReadPb == pb) {
+			data->directReadPb = NULL;
+		}
+	#endif
+
+	ringDrain (&data->ports[portIdx].inRing, buf);
+	if (buf->ioActCount == buf->ioReqCount) {
+		return;
+	}
+	if (!takeBufMutex()) {
+		// An application was interrupted in the middle of a copy, retry soon
+		schedVBLTask();
+		return;
+	}
+	readFromPort (data, portIdx, buf);
+	#if USE_DIRECT_READS
+		// A reader with room for a whole sector, and no input waiting for
+		// it in the driver, gets its next input straight from the host
+		if ((data->directReadPb == NULL) && data->conn.directReads &&
+		    (buf->ioReqCount - buf->ioActCount >= FUJI_SECTOR_SIZE) &&
+		    (portBuffered (data, portIdx) == 0)) {
+			data->directReadPort = portIdx;
+			data->directReadPb   = pb;
+		}
+	#endif
+	releaseBufMutex();
+}
+
+/* Must be called with the port's outBusy flag held. Takes a write into the
+ * port's output ring, which needs no mutex since the holder of outBusy is
+ * its only producer, or for a large write, sends it from where it is.
+ * Returns true if the ring was empty, so that the write does not join
+ * output being held back.
+ */
+
+static Boolean primeWrite (struct FujiSerData *data, IOParam *pb, short portIdx) {
+	struct FujiPort    *port = &data->ports[portIdx];
+	struct FujiRing    *ring = &port->outRing;
+	struct StorageSpec *buf  = (struct StorageSpec*) &pb->ioBuffer;
+
+	#if USE_DIRECT_WRITES
+		// A write of at least a sector, with nothing of its port's ahead
+		// of it, is sent from the caller's buffer in whole sectors without
+		// being copied. It completes once the last of them has gone out
+		// and the rest is in the ring. The buffer mutex keeps two ports
+		// from claiming this at once.
+		if ((data->directPb == NULL) && data->hostTags &&
+		    (data->hostCredit < 0 || data->hostCredit >= FUJI_SECTOR_SIZE) &&
+		    (ringUsed (ring) == 0) &&
+		    (buf->ioReqCount - buf->ioActCount >= FUJI_SECTOR_SIZE) &&
+		    takeBufMutex()) {
+			if (data->directPb == NULL) {
+				data->directPort = portIdx;
+				data->directPb   = pb;
+			}
+			releaseBufMutex();
+		}
+		if (data->directPb == pb) {
+			// Being sent; directWriteDone moves ioActCount on
+			return true;
+		}
+	#endif
+
+	// Other writes complete as soon as all their data is in the ring
+	if (ringUsed (ring) == 0) {
+		port->coalesceFrom = Ticks;
+		ringFill (ring, buf);
+		return true;
+	}
+	ringFill (ring, buf);
+	return false;
+}
+
 static OSErr doPrime (IOParam *pb, DCtlEntry *devCtlEnt) {
 	struct FujiSerData *data = *(FujiSerDataHndl)devCtlEnt->dCtlStorage;
+	const short unitNum = ~devCtlEnt->dCtlRefNum;
 	OSErr err = ioInProgress;
+	Boolean flush = false;
+
+	// fujiSerialInstall sizes the registry to cover all of our units
+	if (unitNum >= data->drvrs->count) {
+		pb->ioResult = badUnitErr;
+		return badUnitErr;
+	}
+
+	// While the link recovers from an error, requests go on as usual,
+	// waiting for it if they must, until it has been down too long
+	if (LINK_FAILED (data) &&
+	    (!USE_RECOVERY || (data->linkDown && (Ticks - data->downSince >= MAX_STALL_TICKS)))) {
+		err = data->conn.iopb.ioResult;
 
-	if (data->inWakeUp || takeVblMutex()) {
-		if (data->conn.iopb.ioResult != noErr) {
-			err = data->conn.iopb.ioResult;
+		// A direct write given up on is not sent again should the link
+		// come back
+		if (data->directPb == pb) {
+			data->directPb = NULL;
+		}
+	} else {
+		const unsigned char cmd     = pb->ioTrap & 0x00FF;
+		const short         portIdx = getPortIndex (devCtlEnt->dCtlRefNum);
+		struct FujiPort    *port    = &data->ports[portIdx];
+
+		if ((cmd == aRdCmd) && takeBusyFlag (&port->inBusy)) {
+			primeRead (data, pb, portIdx);
+			releaseBusyFlag (&port->inBusy);
+		} else if ((cmd == aWrCmd) && takeBusyFlag (&port->outBusy)) {
+			flush = primeWrite (data, pb, portIdx);
+			releaseBusyFlag (&port->outBusy);
 		} else {
-			const unsigned char cmd = pb->ioTrap & 0x00FF;
-			struct StorageSpec *src = 0, *dst;
-			if (cmd == aRdCmd) {
-				src = &data->readStorage;
-				dst = (struct StorageSpec*) &pb->ioBuffer;
-			} else if (cmd == aWrCmd) {
-				src = (struct StorageSpec*) &pb->ioBuffer;
-				dst = &data->writeStorage;
-			}
-			if (src) {
-				bufferCopy (src, dst);
-			}
-			if (pb->ioActCount == pb->ioReqCount) {
-				err = noErr;
+			// Another request for the port was interrupted in the middle
+			// of a copy, retry soon
+			schedVBLTask();
+		}
 
-				if (cmd == aWrCmd) {
-					data->bytesWritten += pb->ioActCount;
-				} else {
-					data->bytesRead    += pb->ioActCount;
-				}
+		if (pb->ioActCount == pb->ioReqCount) {
+			err = noErr;
+
+			if (cmd == aWrCmd) {
+				data->bytesWritten += pb->ioActCount;
+			} else {
+				data->bytesRead    += pb->ioActCount;
 			}
 		}
-		if (!data->inWakeUp) {
-			releaseVblMutex();
+
+		// If the link is idle, start on this request now rather than on
+		// the next tick: send the output just queued, or fetch input into
+		// the read buffer this one may have drained. Output that joins
+		// output being held back waits with it. During a wake-up, linkNext
+		// is called once all requests have been seen.
+		if ((data->linkState != LINK_WAKING) && takeVblMutex()) {
+			if (flush) {
+				port->coalesceFrom = Ticks - port->coalesceTicks;
+			}
+			if (!linkNext (data)) {
+				releaseVblMutex();
+			}
 		}
-	} // data->inWakeUp || takeVblMutex()
+	}
 
 	if (err == ioInProgress) {
 		// Make a record that we are suspended so we can get awoken
-		struct DriverInfo *info = getDriverInfo (data, pb->ioRefNum);
-		info->pendingDce = devCtlEnt;
-		info->pendingPb  = pb;
-		schedVBLTask();
+		struct DriverRegistry *reg = data->drvrs;
+		reg->info[unitNum].pendingDce = devCtlEnt;
+		reg->info[unitNum].pendingPb  = pb;
+		setPendingBit (reg->pending, unitNum);
+
+		// New requests get a poll on the next tick. Requests that are merely
+		// re-queued during a wake-up (e.g. a reader waiting on an idle link)
+		// leave the poll interval to nextPollInterval.
+		if (data->linkState != LINK_WAKING) {
+			schedVBLTask();
+		}
 	}
 
 	pb->ioResult = err;
 	return err;
 }
 
+/* Puts the link and its buffers back to their state before the first
+ * transfer. Called by doOpen with the VBL mutex held.
+ */
+
+static void resetLink (struct FujiSerData *data) {
+	short i;
+
+	data->conn.iopb.ioResult = noErr;
+	data->linkDown           = false;
+
+	data->vblCount   = VBL_TICKS_MIN;
+	data->linkActive = false;
+
+	data->linkState     = LINK_IDLE;
+	data->readDue       = false;
+	data->hostStreaming = false;
+	data->longPollOut   = false;
+	data->idlePolls     = 0;
+
+	// Do not write until the first reply tells us whether the host does
+	// flow control, and if so how much it can take
+	data->hostCredit = 0;
+	data->hostPacks  = false;
+	data->hostTags   = false;
+
+	data->directPb       = NULL;
+	data->directLast     = false;
+	data->directReadPb   = NULL;
+	data->directReadLast = false;
+
+	// The host's numbering is picked up from its first reply; ours carries
+	// on from where it was, so that the host does not take it for repeats
+	data->rxSeq     = 0;
+	data->writesOut = 0;
+
+	for (i = 0; i < 2; i++) {
+		data->readStorage[i].ioBuffer    = data->readData[i].payload;
+		data->readStorage[i].ioReqCount  = 0;
+		data->readStorage[i].ioActCount  = 0;
+
+		data->writeStorage[i].ioBuffer   = data->writeData[i][0].payload;
+		data->writeStorage[i].ioReqCount = NELEMENTS(data->writeData[i][0].payload);
+		data->writeStorage[i].ioActCount = 0;
+		data->writeSectors[i]            = 0;
+	}
+	data->readIdx  = 0;
+	data->writeIdx = 0;
+}
+
 static OSErr doOpen (IOParam *pb, DCtlEntry *dce) {
 	struct FujiSerData *data;
+	short i;
 
 	// Make sure the dCtlStorage was populated by the FujiNet DA
 
@@ -747,31 +2222,68 @@ static OSErr doOpen (IOParam *pb, DCtlEntry *dce) {
 		return portNotCf;
 	}
 
+	// The output rings are allocated by fujiSerialInstall, and the write
+	// buffers by fujiSerialOpen
+
+	for (i = 0; i < FUJI_NUM_PORTS; i++) {
+		if (data->ports[i].outRing.buffer == 0L) {
+			return openErr;
+		}
+	}
+	if ((data->writeData[0] == 0L) || (data->writeData[1] == 0L)) {
+		return openErr;
+	}
+
 	// Figure out which driver we are opening
 	//if (data->mainDrvrRefNum == dce->dCtlRefNum) {
 	//  dce->dCtlFlags |= dNeedLockMask;
 	//}
 
-	// Start the VBL task
-	data->conn.iopb.ioResult = noErr;
-
-	if (data->vblCount == 0) {
-		data->vblCount = VBL_TICKS;
-	}
+	// The link and its buffers are shared by all units, and may have a
+	// transfer on the bus when another unit is opened; they are only set
+	// up when no unit is open yet. Even then, one left on the bus by the
+	// last unit to close, or by the VBL task, may still hold the VBL mutex.
+	// The open waits for it, and fails with portInUse should it not come
+	// free, rather than leave the link as the last session did.
 
-	data->readStorage.ioBuffer    = data->readData.payload;
-	data->readStorage.ioReqCount  = 0;
-	data->readStorage.ioActCount  = 0;
+	if (data->openCount == 0) {
+		const unsigned long until = Ticks + MAX_OPEN_TICKS;
 
-	data->writeStorage.ioBuffer   = data->writeData.payload;
-	data->writeStorage.ioReqCount = NELEMENTS(data->writeData.payload);
-	data->writeStorage.ioActCount = 0;
+		while (!takeVblMutex()) {
+			if ((long) (Ticks - until) >= 0) {
+				return portInUse;
+			}
+		}
+		resetLink (data);
+		releaseVblMutex();
+	}
+	data->openCount++;
 
+	// Start the VBL task
 	fujiStartVBL (dce);
 
 	return noErr;
 }
 
 static OSErr doClose (IOParam *pb, DCtlEntry *devCtlEnt) {
+	struct FujiSerData *data = *(FujiSerDataHndl)devCtlEnt->dCtlStorage;
+	struct FujiPort    *port = &data->ports[getPortIndex (devCtlEnt->dCtlRefNum)];
+
+	// Stop using any SerSetBuf buffer, since the application which owns it
+	// may dispose of it once the port is closed. At application level the
+	// buffer mutex and busy flags are always free, since interrupt code
+	// never keeps them.
+
+	if (takeBusyFlag (&port->inBusy)) {
+		if (takeBufMutex()) {
+			setInputBuffer (port, NULL, 0);
+			releaseBufMutex();
+		}
+		releaseBusyFlag (&port->inBusy);
+	}
+
+	if (data->openCount > 0) {
+		data->openCount--;
+	}
 	return noErr;
 }
\ No newline at end of file
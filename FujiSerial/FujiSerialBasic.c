@@ -256,23 +256,30 @@ static OSErr doPrime (IOParam *pb, DCtlEntry *devCtlEnt) {
 			Ptr inBytesPtr = pb->ioBuffer;
 			SER_WRIT_INDICATOR (LED_START_IO);
 			while (inOutBytes > 0) {
-				// Determine how much to write
+				// Determine how much to write: whole sectors, as many as
+				// FujiNet takes in one request, or else what is left over
 				long bytesToWrite = inOutBytes;
+				if (bytesToWrite > 512L * data->conn.extent) {
+					bytesToWrite = 512L * data->conn.extent;
+				}
 				if (bytesToWrite > 512) {
-					bytesToWrite = 512;
+					bytesToWrite &= ~511L;
 				}
 
-				// Write a block of data
+				// Write a block of data. Every sector of a multi-sector
+				// write gets the same tags, so they must all be full.
 				FUJI_TAG_ID  = MAC_FUJI_REQUEST_TAG;
 				FUJI_TAG_SRC = (getSource (devCtlEnt->dCtlRefNum) << 8);
-				FUJI_TAG_LEN = bytesToWrite;
-				data->conn.iopb.ioBuffer = inBytesPtr;
+				FUJI_TAG_LEN = MIN (bytesToWrite, 512);
+				data->conn.iopb.ioBuffer   = inBytesPtr;
+				data->conn.iopb.ioReqCount = bytesToWrite;
 				err = PBWriteSync ((ParmBlkPtr)&data->conn.iopb);
 				if (err) break;
 				// Increment pointers
 				inBytesPtr += bytesToWrite;
 				inOutBytes -= bytesToWrite;
 			}
+			data->conn.iopb.ioReqCount = 512;
 			pb->ioActCount      = pb->ioReqCount - inOutBytes;
 			data->bytesWritten += pb->ioReqCount - inOutBytes;
 		#else
@@ -146,6 +146,16 @@ static OSErr printDriverStatus() {
 			printf("Driver ref number     %d\n", (*data)->conn.iopb.ioRefNum);
 			printf("Drive number:         %d\n", (*data)->conn.iopb.ioVRefNum);
 			printf("Magic sector:         %ld\n", (*data)->conn.iopb.ioPosOffset / 512);
+			printf("Poll interval:        %d ticks\n", (*data)->vblCount);
+			printf("Chained transfers:    %ld\n", (*data)->chainedStarts);
+			printf("VBL task transfers:   %ld\n", (*data)->vblStarts);
+			printf("Queued transfers:     %ld\n", (*data)->queuedStarts);
+			printf("I/O errors:           %ld\n", (*data)->ioErrors);
+			printf("Wrong tag errors:     %ld\n", (*data)->tagErrors);
+			printf("Duplicate replies:    %ld\n", (*data)->seqDups);
+			printf("Replies after a gap:  %ld\n", (*data)->seqGaps);
+			printf("Reconnects:           %ld (%ld failed)\n", (*data)->recoveries, (*data)->recoverFails);
+			printf("Time disconnected:    %ld ticks%s\n", (*data)->downTicks, (*data)->linkDown ? ", down now" : "");
 		}
 
 		printf("Total bytes read:     %ld\n", bytesRead);
@@ -155,30 +165,6 @@ static OSErr printDriverStatus() {
 	}
 }
 
-static OSErr setVBLFrequency() {
-	if (isFujiModemRedirected()) {
-		OSErr err;
-		short sInputRefNum, sOutputRefNum;
-		FujiSerDataHndl data = getFujiSerialDataHndl ();
-
-		err = OpenDriver("\p.AOut",  &sOutputRefNum); CHECK_ERR;
-		err = OpenDriver("\p.AIn",   &sInputRefNum); CHECK_ERR;
-
-		if (data) {
-			short count;
-			printf("Current VBL interval: %d\n", (*data)->vblCount);
-			printf("Please enter new VBL interval (1-255): ");
-			scanf("%d", &count);
-			(*data)->vblCount = count;
-		}
-
-		CloseDriver(sInputRefNum);
-		CloseDriver(sOutputRefNum);
-	} else {
-		printf("Please connect to the FujiNet and redirect the serial port first\n");
-	}
-}
-
 static OSErr testFujiWrite() {
 	short sFujiRefNum;
 	ParamBlockRec pb;
@@ -284,7 +270,6 @@ static OSErr drvrHelp() {
 	printf("5: Test serial driver\n");
 	printf("6: Test serial throughput with blocking I/O\n");
 	printf("7: Test serial throughput with non-blocking I/O\n");
-	printf("8: Set VBL frequency\n");
 	printf("q: Main menu\n");
 	return noErr;
 }
@@ -298,7 +283,6 @@ static OSErr drvrChoice(char mode) {
 		case '5': testSerialDriver(); break;
 		case '6': testSerialThroughput (false); break;
 		case '7': testSerialThroughput (true); break;
-		case '8': setVBLFrequency(); break;
 		default: -1;
 	}
 	return noErr;
@@ -0,0 +1,144 @@
+/****************************************************************************
+ *   mac68k-fuji-drivers (c) 2024 Marcio Teixeira                           *
+ *                                                                          *
+ *   This program is free software: you can redistribute it and/or modify   *
+ *   it under the terms of the GNU General Public License as published by   *
+ *   the Free Software Foundation, either version 3 of the License, or      *
+ *   (at your option) any later version.                                    *
+ *                                                                          *
+ *   This program is distributed in the hope that it will be useful,        *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of         *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the          *
+ *   GNU General Public License for more details.                           *
+ *                                                                          *
+ *   To view a copy of the GNU General Public License, go to the following  *
+ *   location: <http://www.gnu.org/licenses/>.                              *
+ ****************************************************************************/
+
+/**
+ * Counts the operations the Async driver does to copy the data of a read or
+ * write, per call, for calls of a few sizes. Before is with every copy done
+ * by the BlockMove trap and the sanity checks in bufferCopy, as the driver
+ * used to be built; after is with small copies done by a loop, as in
+ * FujiCommon/FujiRingOps.h, and the checks left to debug builds.
+ *
+ * The paths are those of doPrime: a write copies into the port's output
+ * ring; a read copies out of the port's input ring, or out of a sector kept
+ * in the read buffer. Rings wrap, so a copy is sometimes split in two; the
+ * counts are averaged over many calls.
+ *
+ * This is plain C, like the code it exercises. To compile:
+ *
+ *    gcc -O2 -o fuji_copy_bench fuji_copy_bench.c
+ *
+ * Usage:
+ *
+ *    ./fuji_copy_bench
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+static long traps;       // BlockMove calls
+static long trapBytes;   // Bytes moved by them
+static long smallCopy;   // FUJI_SMALL_COPY for the run
+
+#define FUJI_RING_COPY(src, dst, len) (traps++, trapBytes += (len), memmove (dst, src, len))
+#define FUJI_SMALL_COPY smallCopy
+
+#include "../FujiCommon/FujiRingOps.h"
+
+#define RING_SIZE        1024  // INPUT_RING_SIZE in FujiSerialInit.c
+#define SECTOR_PAYLOAD    500
+#define CALLS          100000
+#define SANITY_CHECKS       7  // Comparisons in bufferCopy under SANITY_CHECK
+
+enum Path {PATH_WRITE, PATH_RING_READ, PATH_SECTOR_READ, NUM_PATHS};
+
+static const char *pathNames[NUM_PATHS] = {"write", "read ring", "read sector"};
+
+struct Counts {
+	double traps;
+	double loopBytes;
+	double checks;
+};
+
+/* Mirrors bufferCopy in FujiSerialAsync.c, counting its sanity checks */
+
+static long sectorCopy (const char *src, long *srcPos, char *dst, long len, int sanity, long *checks) {
+	long n = SECTOR_PAYLOAD - *srcPos;
+	if (sanity) {
+		*checks += SANITY_CHECKS;
+	}
+	if (n > len) {
+		n = len;
+	}
+	fujiCopy (src + *srcPos, dst, n);
+	*srcPos += n;
+	if (*srcPos == SECTOR_PAYLOAD) {
+		*srcPos = 0;
+	}
+	return n;
+}
+
+static struct Counts run (enum Path path, long size, int after) {
+	static char     storage[RING_SIZE];
+	static char     sector[SECTOR_PAYLOAD];
+	char            app[SECTOR_PAYLOAD];
+	struct FujiRing ring;
+	struct Counts   c;
+	long            bytes = 0, checks = 0, sectorPos = 0;
+	long            i;
+
+	ring.buffer = storage;
+	ring.size   = RING_SIZE;
+	ring.head   = 0;
+	ring.tail   = 0;
+	traps       = 0;
+	trapBytes   = 0;
+	smallCopy   = after ? 16 : 0;
+
+	for (i = 0; i < CALLS; i++) {
+		switch (path) {
+			case PATH_WRITE:
+				// The scheduler drains the ring; that copy is not counted
+				bytes += ringPut (&ring, app, size);
+				ring.tail = ring.head;
+				break;
+			case PATH_RING_READ:
+				ring.head = (ring.head + size) % RING_SIZE;
+				bytes += ringGet (&ring, app, size);
+				break;
+			case PATH_SECTOR_READ:
+				bytes += sectorCopy (sector, &sectorPos, app, size, !after, &checks);
+				break;
+			default:
+				break;
+		}
+	}
+	c.traps     = (double) traps / CALLS;
+	c.loopBytes = (double) (bytes - trapBytes) / CALLS;
+	c.checks    = (double) checks / CALLS;
+	return c;
+}
+
+int main (void) {
+	static const long sizes[] = {1, 4, 16, 17, 64, 500};
+	size_t i;
+	int    p;
+
+	printf ("Operations per call, averaged over %d calls\n\n", CALLS);
+	printf ("%6s %-12s | %8s %8s %8s | %8s %8s %8s\n", "", "", "before", "", "", "after", "", "");
+	printf ("%6s %-12s | %8s %8s %8s | %8s %8s %8s\n", "bytes", "path", "traps", "loop B", "checks", "traps", "loop B", "checks");
+	for (i = 0; i < sizeof (sizes) / sizeof (sizes[0]); i++) {
+		for (p = 0; p < NUM_PATHS; p++) {
+			const struct Counts b = run ((enum Path) p, sizes[i], 0);
+			const struct Counts a = run ((enum Path) p, sizes[i], 1);
+			printf ("%6ld %-12s | %8.2f %8.2f %8.2f | %8.2f %8.2f %8.2f\n",
+				sizes[i], pathNames[p],
+				b.traps, b.loopBytes, b.checks,
+				a.traps, a.loopBytes, a.checks);
+		}
+	}
+	return 0;
+}
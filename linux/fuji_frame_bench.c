@@ -0,0 +1,298 @@
+/****************************************************************************
+ *   mac68k-fuji-drivers (c) 2024 Marcio Teixeira                           *
+ *                                                                          *
+ *   This program is free software: you can redistribute it and/or modify   *
+ *   it under the terms of the GNU General Public License as published by   *
+ *   the Free Software Foundation, either version 3 of the License, or      *
+ *   (at your option) any later version.                                    *
+ *                                                                          *
+ *   This program is distributed in the hope that it will be useful,        *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of         *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the          *
+ *   GNU General Public License for more details.                           *
+ *                                                                          *
+ *   To view a copy of the GNU General Public License, go to the following  *
+ *   location: <http://www.gnu.org/licenses/>.                              *
+ ****************************************************************************/
+
+/**
+ * Microbenchmark for the packed sector format in FujiCommon/FujiFrameOps.h
+ *
+ * For a few mixes of interactive and bulk traffic on the three ports, this
+ * counts the sectors needed with one port per sector, as older hosts do, and
+ * with packed sectors, along with how full the sectors are and how many
+ * slots interactive and bulk bytes wait on average. Every packed sector is
+ * taken apart again and its bytes checked. It then times building and
+ * taking apart a typical sector.
+ *
+ * This is plain C, like the code it exercises. To compile:
+ *
+ *    gcc -O2 -o fuji_frame_bench fuji_frame_bench.c
+ *
+ * Usage:
+ *
+ *    ./fuji_frame_bench [slots]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#pragma GCC diagnostic ignored "-Wunused-function" // Not all are used here
+#include "../FujiCommon/FujiFrameOps.h"
+
+#define INTERACTIVE_BYTES  32      // As in FujiSerialAsync.c
+#define MAX_CHUNKS       4096
+
+// A load offers each port "bytes" every "every" sector slots
+
+struct Load {
+	const char *name;
+	struct {
+		long bytes;
+		long every;
+	} port[FUJI_NUM_PORTS];
+};
+
+static const struct Load loads[] = {
+	{"keys + status",     {{  1,  6}, {  4, 15}, {  0,  0}}},
+	{"keys + bulk",       {{  1,  6}, {480,  1}, {  0,  0}}},
+	{"keys + 2 bulk",     {{  1,  6}, {240,  1}, {240,  1}}},
+	{"3 interactive",     {{  1,  4}, {  4, 15}, { 16, 30}}},
+	{"bulk + bulk",       {{300,  1}, {300,  1}, {  0,  0}}},
+};
+
+// Bytes queued on a port, as chunks stamped with the slot they arrived in
+
+struct Chunk {
+	long slot;
+	long bytes;
+};
+
+struct Queue {
+	struct Chunk  chunks[MAX_CHUNKS];
+	long          head, tail;
+	long          queued;
+	unsigned char nextOut;  // Pattern byte for the next byte sent
+	unsigned char nextIn;   // Pattern byte expected for the next byte received
+};
+
+struct Result {
+	long   sectors;
+	long   dataBytes;
+	long   waitSlots[2];  // Summed over bulk and interactive bytes
+	long   waitBytes[2];
+	long   errors;
+};
+
+static struct Queue queues[FUJI_NUM_PORTS];
+
+static void push (struct Queue *q, long slot, long bytes) {
+	if (q->head - q->tail == MAX_CHUNKS) {
+		fprintf (stderr, "Too many chunks queued\n");
+		exit (1);
+	}
+	q->chunks[q->head % MAX_CHUNKS].slot  = slot;
+	q->chunks[q->head % MAX_CHUNKS].bytes = bytes;
+	q->head++;
+	q->queued += bytes;
+}
+
+/* Takes n bytes off a queue into dst, accounting for how long they waited */
+
+static void take (struct Queue *q, const struct Load *load, int p, long slot, unsigned char *dst, long n, struct Result *r) {
+	const int interactive = load->port[p].bytes <= INTERACTIVE_BYTES;
+	long i;
+
+	for (i = 0; i < n; i++) {
+		dst[i] = q->nextOut++;
+	}
+	q->queued -= n;
+	while (n) {
+		struct Chunk *c    = &q->chunks[q->tail % MAX_CHUNKS];
+		const long    part = (n < c->bytes) ? n : c->bytes;
+		r->waitSlots[interactive] += part * (slot - c->slot);
+		r->waitBytes[interactive] += part;
+		c->bytes -= part;
+		n        -= part;
+		if (c->bytes == 0) {
+			q->tail++;
+		}
+	}
+}
+
+/* Picks the port to go first: one in the interactive slot, otherwise the
+ * next with something queued after the last one picked, as the driver does.
+ */
+
+static int pickPort (int *rr) {
+	int p, k;
+	for (p = 0; p < FUJI_NUM_PORTS; p++) {
+		if (queues[p].queued && queues[p].queued <= INTERACTIVE_BYTES) {
+			return p;
+		}
+	}
+	for (k = 1; k <= FUJI_NUM_PORTS; k++) {
+		p = (*rr + k) % FUJI_NUM_PORTS;
+		if (queues[p].queued) {
+			*rr = p;
+			return p;
+		}
+	}
+	return -1;
+}
+
+/* Takes apart a packed frame, checking the bytes of each record against the
+ * pattern its port was sent with.
+ */
+
+static void unpack (unsigned char *frame, long len, struct Result *r) {
+	long offset = 0;
+
+	if (!frameValid (frame, len, FUJI_NUM_PORTS)) {
+		r->errors++;
+		return;
+	}
+	while (!frameAtEnd (frame, offset, len)) {
+		const unsigned char *rec  = frame + offset;
+		struct Queue        *q    = &queues[FUJI_RECORD_PORT (rec) - FUJI_PORT_MODEM];
+		const long           n    = FUJI_RECORD_LENGTH (rec);
+		long                 i;
+
+		for (i = 0; i < n; i++) {
+			if (rec[FUJI_RECORD_HEADER_SIZE + i] != q->nextIn++) {
+				r->errors++;
+			}
+		}
+		offset = frameConsume (frame, offset, n);
+	}
+}
+
+/* Runs a load for a number of slots, then until the queues are empty. In
+ * each slot one sector goes out if anything is queued.
+ */
+
+static struct Result run (const struct Load *load, long slots, int packed) {
+	unsigned char frame[FUJI_PAYLOAD_SIZE];
+	struct Result r;
+	long          slot;
+	int           rr = FUJI_NUM_PORTS - 1;
+	int           p;
+
+	memset (&r, 0, sizeof (r));
+	memset (queues, 0, sizeof (queues));
+
+	for (slot = 0; ; slot++) {
+		long queued = 0, used = 0;
+		int  first;
+
+		for (p = 0; p < FUJI_NUM_PORTS; p++) {
+			if (slot < slots && load->port[p].bytes && (slot % load->port[p].every) == 0) {
+				push (&queues[p], slot, load->port[p].bytes);
+			}
+			queued += queues[p].queued;
+		}
+		if (queued == 0) {
+			if (slot >= slots) {
+				break;
+			}
+			continue;
+		}
+
+		first = pickPort (&rr);
+		if (!packed) {
+			const long n = (queues[first].queued < FUJI_PAYLOAD_SIZE) ? queues[first].queued : FUJI_PAYLOAD_SIZE;
+			take (&queues[first], load, first, slot, frame, n, &r);
+			queues[first].nextIn += (unsigned char) n;
+			r.dataBytes += n;
+		} else {
+			int k;
+			for (k = 0; k < FUJI_NUM_PORTS; k++) {
+				const long room = frameRoom (used, FUJI_PAYLOAD_SIZE);
+				long       n;
+
+				p = (first + k) % FUJI_NUM_PORTS;
+				n = (queues[p].queued < room) ? queues[p].queued : room;
+				if (n) {
+					take (&queues[p], load, p, slot, frame + used + FUJI_RECORD_HEADER_SIZE, n, &r);
+					frameAppend (frame, &used, FUJI_PORT_MODEM + p, n);
+					r.dataBytes += n;
+				}
+			}
+			if (used < FUJI_PAYLOAD_SIZE) {
+				memset (frame + used, 0, FUJI_PAYLOAD_SIZE - used);
+			}
+			unpack (frame, FUJI_PAYLOAD_SIZE, &r);
+		}
+		r.sectors++;
+	}
+	return r;
+}
+
+/* Times building and taking apart a sector with a keystroke, a status poll
+ * and bulk data, which is the common case for packing.
+ */
+
+static void timeCodec (void) {
+	const long      iterations = 2000000;
+	unsigned char   frame[FUJI_PAYLOAD_SIZE];
+	unsigned char   src[FUJI_PAYLOAD_SIZE], dst[FUJI_NUM_PORTS][FUJI_PAYLOAD_SIZE];
+	const long      sizes[FUJI_NUM_PORTS] = {1, 4, 400};
+	struct timespec t0, t1;
+	unsigned long   check = 0;
+	double          ns;
+	long            i;
+	int             p;
+
+	for (i = 0; i < FUJI_PAYLOAD_SIZE; i++) {
+		src[i] = (unsigned char) i;
+	}
+	clock_gettime (CLOCK_MONOTONIC, &t0);
+	for (i = 0; i < iterations; i++) {
+		long used = 0, offset = 0;
+
+		for (p = 0; p < FUJI_NUM_PORTS; p++) {
+			memcpy (frame + used + FUJI_RECORD_HEADER_SIZE, src, sizes[p]);
+			frameAppend (frame, &used, FUJI_PORT_MODEM + p, sizes[p]);
+		}
+		if (!frameValid (frame, used, FUJI_NUM_PORTS)) {
+			abort ();
+		}
+		while (!frameAtEnd (frame, offset, used)) {
+			const long n = FUJI_RECORD_LENGTH (frame + offset);
+			p = FUJI_RECORD_PORT (frame + offset) - FUJI_PORT_MODEM;
+			memcpy (dst[p], frame + offset + FUJI_RECORD_HEADER_SIZE, n);
+			offset = frameConsume (frame, offset, n);
+		}
+		check += dst[i % FUJI_NUM_PORTS][0] + (unsigned long) used;
+	}
+	clock_gettime (CLOCK_MONOTONIC, &t1);
+
+	ns = ((t1.tv_sec - t0.tv_sec) * 1e9 + (t1.tv_nsec - t0.tv_nsec)) / iterations;
+	printf ("\nBuild and take apart a 3-record sector: %.1f ns (check %lu)\n", ns, check % 10);
+}
+
+int main (int argc, char **argv) {
+	const long slots = (argc > 1) ? atol (argv[1]) : 6000;
+	size_t     i;
+
+	printf ("%ld sector slots per load\n\n", slots);
+	printf ("%-16s %-8s %8s %8s %12s %12s %8s\n", "load", "format", "sectors", "fill", "inter. wait", "bulk wait", "errors");
+	for (i = 0; i < sizeof (loads) / sizeof (loads[0]); i++) {
+		int packed;
+		for (packed = 0; packed < 2; packed++) {
+			const struct Result r = run (&loads[i], slots, packed);
+			printf ("%-16s %-8s %8ld %7.1f%% %12.2f %12.2f %8ld\n",
+				packed ? "" : loads[i].name,
+				packed ? "packed" : "single",
+				r.sectors,
+				100.0 * r.dataBytes / ((double) r.sectors * FUJI_PAYLOAD_SIZE),
+				r.waitBytes[1] ? (double) r.waitSlots[1] / r.waitBytes[1] : 0.0,
+				r.waitBytes[0] ? (double) r.waitSlots[0] / r.waitBytes[0] : 0.0,
+				r.errors);
+		}
+	}
+	timeCodec ();
+	return 0;
+}
@@ -0,0 +1,339 @@
+/****************************************************************************
+ *   mac68k-fuji-drivers (c) 2024 Marcio Teixeira                           *
+ *                                                                          *
+ *   This program is free software: you can redistribute it and/or modify   *
+ *   it under the terms of the GNU General Public License as published by   *
+ *   the Free Software Foundation, either version 3 of the License, or      *
+ *   (at your option) any later version.                                    *
+ *                                                                          *
+ *   This program is distributed in the hope that it will be useful,        *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of         *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the          *
+ *   GNU General Public License for more details.                           *
+ *                                                                          *
+ *   To view a copy of the GNU General Public License, go to the following  *
+ *   location: <http://www.gnu.org/licenses/>.                              *
+ ****************************************************************************/
+
+/**
+ * Reference implementation of the host half of the FujiNet link.
+ *
+ * The FujiNet device calls macWrote() when the Mac writes the magic sector
+ * and macRead() when the Mac reads it; for a request that covers several
+ * sectors of the extent, once per sector, in order. Firmware that can return
+ * tags with a write should fill them in with writeStatus() after macWrote(),
+ * and pass macWrote() the tags the Mac wrote, since once it has seen the
+ * write status the Mac may frame large writes in them. If the firmware says
+ * it takes direct reads when answering the magic sector, it should call
+ * macReadDirect() when the Mac reads a sector of the extent whose number is
+ * that of a port, and send the tags it fills in with the sector. If it says
+ * it takes long polls, it may hold a read of FUJI_LONG_POLL_SECTOR until
+ * readReady() returns true, and then answer it with macRead(). The host side
+ * of the connection (a TCP socket, a modem emulator, etc.) queues bytes for
+ * the Mac with send() and takes the bytes written by the Mac with receive().
+ *
+ * The sector header is described in FujiCommon/FujiLink.h. This handler
+ * advertises the free space in its receive buffer as credit in every reply,
+ * and honors the credit advertised by the Mac. Either can be turned off to
+ * behave like a host which predates flow control.
+ *
+ * Bytes are kept apart by port: those from the Mac by the src byte of the
+ * sectors it writes, and those for the Mac are sent one port per sector,
+ * taking turns, with the dst byte set. Bytes from a Mac which predates ports
+ * are taken to be for the modem port. When the Mac accepts packed sectors,
+ * a sector holds records for every port with something to send.
+ *
+ * Replies are numbered as described in FujiLink.h. Sectors from the Mac
+ * that arrive twice are dropped and counted in duplicates, and those that
+ * arrive ahead of missing ones are dropped and counted in seqGaps, until
+ * the device side calls macKnocked() on seeing the knock sequence.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <string.h>
+
+#include <algorithm>
+#include <deque>
+
+#include "../FujiCommon/FujiLink.h"
+
+// Not every routine in FujiFrameOps.h is needed by the host
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wunused-function"
+#include "../FujiCommon/FujiFrameOps.h"
+#pragma GCC diagnostic pop
+
+class FujiHostHandler {
+    public:
+        FujiHostHandler (size_t rxCapacity, bool useCredit, bool usePacking = true) :
+            rxCapacity(rxCapacity), useCredit(useCredit), usePacking(usePacking),
+            longPollMs(0), macCredit(-1), macPacks(false), dropped(0), duplicates(0), seqGaps(0),
+            rxTotal(0), txPort(0), txSeq(0), macSeq(0), directSeq(0), directRun(0), knocked(false) {}
+
+        // Device side
+
+        void macWrote (const uint8_t *sector, const uint8_t *tags = 0);
+        void macRead  (uint8_t *sector);
+        void macReadDirect (uint8_t *sector, uint8_t *tags, int port);
+        void writeStatus (uint8_t *tags) const;
+        void macKnocked () {knocked = true; directSeq = 0;}
+        bool readReady (long heldMs) const {return txUsed() || heldMs >= longPollMs;}
+
+        // Host side
+
+        void   send    (const uint8_t *data, size_t len, int port = FUJI_PORT_MODEM);
+        size_t receive (uint8_t *data, size_t len, int port = FUJI_PORT_MODEM);
+
+        size_t rxUsed (int port) const {return rx[port - FUJI_PORT_MODEM].size();}
+        size_t txUsed (int port) const {return tx[port - FUJI_PORT_MODEM].size();}
+        size_t rxUsed ()  const {return rxTotal;}
+        size_t rxFree ()  const {return rxCapacity - rxTotal;}
+        size_t txUsed ()  const;
+
+        const size_t        rxCapacity;
+        const bool          useCredit;
+        const bool          usePacking;
+        long                longPollMs; // Longest a long poll is held, 0 for none
+        long                macCredit;  // Bytes the Mac can accept, or -1 if unknown
+        bool                macPacks;   // The Mac accepts packed sectors
+        long                dropped;    // Bytes from the Mac that did not fit
+        long                duplicates; // Sectors from the Mac dropped as repeats
+        long                seqGaps;    // Sectors from the Mac dropped after missing ones
+
+    private:
+        std::deque<uint8_t> rx[FUJI_NUM_PORTS]; // From the Mac, waiting for receive()
+        std::deque<uint8_t> tx[FUJI_NUM_PORTS]; // For the Mac, waiting for macRead()
+        size_t              rxTotal;    // Bytes in all of rx, which share rxCapacity
+        int                 txPort;     // Index of the port sent from last
+        uint16_t            txSeq;      // Number of the next reply
+        uint16_t            macSeq;     // Expected on the next sector from the Mac, or 0
+        uint16_t            directSeq;  // Number in the tags of the last direct write
+        uint16_t            directRun;  // Sectors of it seen before this one
+        bool                knocked;    // The next sector from the Mac may skip ahead
+
+        bool   inSequence    (uint16_t seq);
+        void   receiveSector (const uint8_t *header, const uint8_t *payload, size_t size);
+        void   receiveRecord (int port, const uint8_t *data, size_t len);
+        size_t packedRead    (uint8_t *sector, size_t budget);
+
+        static uint32_t getLong  (const uint8_t *p) {return (uint32_t(p[0]) << 24) | (p[1] << 16) | (p[2] << 8) | p[3];}
+        static uint16_t getShort (const uint8_t *p) {return (p[0] << 8) | p[1];}
+        static void     putLong  (uint8_t *p, uint32_t v) {p[0] = v >> 24; p[1] = v >> 16; p[2] = v >> 8; p[3] = v;}
+        static void     putShort (uint8_t *p, uint16_t v) {p[0] = v >> 8;  p[1] = v;}
+};
+
+#define FUJI_TAG(a,b,c,d) ((uint32_t(a) << 24) | (uint32_t(b) << 16) | (uint32_t(c) << 8) | uint32_t(d))
+
+// A direct write has its header in the tags and all of the sector as
+// payload; any other write has both in the sector. The tags of a direct
+// write number its first sector, so the ones after it are counted on. A
+// direct write sent again after a knock starts the count over.
+
+inline void FujiHostHandler::macWrote (const uint8_t *sector, const uint8_t *tags) {
+    if (tags && getLong(tags) == FUJI_TAG('N','D','E','V')) {
+        const uint16_t seq = getShort(tags + 10);
+        directRun = (FUJI_HAS_SEQ(seq) && seq == directSeq) ? directRun + 1 : 0;
+        directSeq = seq;
+        if (inSequence(FUJI_HAS_SEQ(seq) ? FUJI_SEQ(seq + directRun) : 0)) {
+            receiveSector(tags, sector, FUJI_SECTOR_SIZE);
+        }
+    } else if (getLong(sector) == FUJI_TAG('N','D','E','V')) {
+        directSeq = 0;
+        if (inSequence(getShort(sector + 10))) {
+            receiveSector(sector, sector + FUJI_HEADER_SIZE, FUJI_PAYLOAD_SIZE);
+        }
+    }
+}
+
+// Returns false for a sector from the Mac that was seen before, or that
+// came ahead of one that went missing. The Mac sends the missing one again
+// after knocking, followed by the rest, so these are not lost. A Mac which
+// has started over knocks too, so the first sector after a knock is only
+// dropped if it was seen before.
+
+inline bool FujiHostHandler::inSequence (uint16_t seq) {
+    if (!FUJI_HAS_SEQ(seq)) {
+        return true;
+    }
+    if (macSeq) {
+        if (FUJI_SEQ_DUPLICATE(seq, macSeq)) {
+            duplicates++;
+            return false;
+        }
+        if (FUJI_SEQ_AHEAD(seq, macSeq) && !knocked) {
+            seqGaps++;
+            return false;
+        }
+    }
+    knocked = false;
+    macSeq  = FUJI_SEQ(seq + 1);
+    return true;
+}
+
+inline void FujiHostHandler::receiveSector (const uint8_t *header, const uint8_t *payload, size_t size) {
+    const uint16_t credit  = getShort(header + 8);
+    const size_t   len     = std::min<size_t>(getShort(header + 6), size);
+
+    if (header[4] == FUJI_PORT_PACKED) {
+        if (frameValid(payload, len, FUJI_NUM_PORTS)) {
+            for (long i = 0; !frameAtEnd(payload, i, len); i = frameNext(payload, i)) {
+                receiveRecord(FUJI_RECORD_PORT(payload + i), payload + i + FUJI_RECORD_HEADER_SIZE, FUJI_RECORD_LENGTH(payload + i));
+            }
+        }
+    } else {
+        const int src = (header[4] >= FUJI_PORT_MODEM && header[4] <= FUJI_NUM_PORTS) ? header[4] : FUJI_PORT_MODEM;
+        receiveRecord(src, payload, len);
+    }
+    macCredit = FUJI_HAS_CREDIT(credit) ? FUJI_CREDIT_BYTES(credit) : -1;
+    macPacks  = header[5] == FUJI_PORT_PACKED;
+}
+
+inline void FujiHostHandler::receiveRecord (int port, const uint8_t *data, size_t len) {
+    const size_t fits = std::min(len, rxFree());
+
+    // A Mac that honors our credit never sends more than fits; one that
+    // predates flow control may, and the excess is lost
+
+    std::deque<uint8_t> &q = rx[port - FUJI_PORT_MODEM];
+    q.insert(q.end(), data, data + fits);
+    rxTotal += fits;
+    dropped += len - fits;
+}
+
+inline void FujiHostHandler::macRead (uint8_t *sector) {
+    const size_t budget = (useCredit && macCredit >= 0) ? macCredit : FUJI_PAYLOAD_SIZE;
+    int          ready  = 0;
+    for (int i = 0; i < FUJI_NUM_PORTS; i++) {
+        ready += !tx[i].empty();
+    }
+
+    memset(sector, 0, FUJI_HEADER_SIZE + FUJI_PAYLOAD_SIZE);
+    putLong(sector, FUJI_TAG('F','U','J','I'));
+    sector[4] = usePacking ? FUJI_PORT_PACKED : 0;
+    putShort(sector + 8, useCredit ? FUJI_CREDIT(rxFree()) : 0);
+    putShort(sector + 10, FUJI_SEQ(txSeq++));
+
+    if (macPacks && ready > 1) {
+        const size_t sent = packedRead(sector, budget);
+        if (macCredit > 0) {
+            macCredit -= std::min<long>(macCredit, sent);
+        }
+        return;
+    }
+
+    // Take turns between the ports with something to send. The bytes
+    // available are those of the chosen port, since the Mac counts them
+    // towards the port the sector is for.
+
+    for (int i = 0; i < FUJI_NUM_PORTS; i++) {
+        txPort = (txPort + 1) % FUJI_NUM_PORTS;
+        if (!tx[txPort].empty()) {
+            break;
+        }
+    }
+    std::deque<uint8_t> &q = tx[txPort];
+
+    size_t avail = q.size();
+    size_t len   = std::min<size_t>(avail, FUJI_PAYLOAD_SIZE);
+    if (useCredit && macCredit >= 0 && (long)len > macCredit) {
+        // The Mac takes a full sector of payload whenever more than that is
+        // available, so when its credit limits us, report only what we send
+        len   = macCredit;
+        avail = len;
+    }
+
+    sector[5] = FUJI_PORT_MODEM + txPort;
+    putShort(sector + 6, std::min<size_t>(avail, 0x7FFF));
+    std::copy(q.begin(), q.begin() + len, sector + FUJI_HEADER_SIZE);
+    q.erase(q.begin(), q.begin() + len);
+
+    if (macCredit > 0) {
+        macCredit -= std::min<long>(macCredit, len);
+    }
+}
+
+// A direct read, described in FujiLink.h: the header goes in the tags and up
+// to a whole sector of the port's data in the sector. The Mac only asks when
+// the application has room for it, so the credit does not apply.
+
+inline void FujiHostHandler::macReadDirect (uint8_t *sector, uint8_t *tags, int port) {
+    std::deque<uint8_t> &q = tx[port - FUJI_PORT_MODEM];
+    const size_t avail = q.size();
+    const size_t len   = std::min<size_t>(avail, FUJI_SECTOR_SIZE);
+
+    memset(sector, 0, FUJI_SECTOR_SIZE);
+    memset(tags,   0, FUJI_HEADER_SIZE);
+    putLong (tags,     FUJI_TAG('F','U','J','I'));
+    tags[4] = usePacking ? FUJI_PORT_PACKED : 0;
+    tags[5] = port;
+    putShort(tags + 6, std::min<size_t>(avail, 0x7FFF));
+    putShort(tags + 8, useCredit ? FUJI_CREDIT(rxFree()) : 0);
+    putShort(tags + 10, FUJI_SEQ(txSeq++));
+
+    std::copy(q.begin(), q.begin() + len, sector);
+    q.erase(q.begin(), q.begin() + len);
+}
+
+// Fills the payload with a record from each port with something to send,
+// taking turns as to which goes first, and returns the bytes of data sent
+
+inline size_t FujiHostHandler::packedRead (uint8_t *sector, size_t budget) {
+    uint8_t *frame = sector + FUJI_HEADER_SIZE;
+    long     used  = 0;
+    size_t   sent  = 0;
+    const int first = (txPort + 1) % FUJI_NUM_PORTS;
+
+    for (int k = 0; k < FUJI_NUM_PORTS; k++) {
+        const int p = (first + k) % FUJI_NUM_PORTS;
+        std::deque<uint8_t> &q = tx[p];
+        const size_t n = std::min({q.size(), budget - sent, (size_t)frameRoom(used, FUJI_PAYLOAD_SIZE)});
+        if (n) {
+            std::copy(q.begin(), q.begin() + n, frame + used + FUJI_RECORD_HEADER_SIZE);
+            q.erase(q.begin(), q.begin() + n);
+            frameAppend(frame, &used, FUJI_PORT_MODEM + p, n);
+            sent  += n;
+            txPort = p;
+        }
+    }
+
+    // The Mac takes a full sector whenever more is available, and the
+    // records end at the first zero header, so the padding is harmless
+
+    const bool limited = (sent == budget) && (budget < FUJI_PAYLOAD_SIZE);
+    sector[5] = FUJI_PORT_PACKED;
+    putShort(sector + 6, std::min<size_t>(used + (limited ? 0 : txUsed()), 0x7FFF));
+    return sent;
+}
+
+inline void FujiHostHandler::send (const uint8_t *data, size_t len, int port) {
+    std::deque<uint8_t> &q = tx[port - FUJI_PORT_MODEM];
+    q.insert(q.end(), data, data + len);
+}
+
+// The write status described in FujiLink.h, for the 12 tag bytes
+
+inline void FujiHostHandler::writeStatus (uint8_t *tags) const {
+    putLong (tags,     FUJI_TAG('F','U','J','I'));
+    putShort(tags + 4, useCredit ? FUJI_CREDIT(rxFree()) : 0);
+    putShort(tags + 6, std::min<size_t>(txUsed(), 0x7FFF));
+    putLong (tags + 8, FUJI_STATUS_TAG);
+}
+
+inline size_t FujiHostHandler::receive (uint8_t *data, size_t len, int port) {
+    std::deque<uint8_t> &q = rx[port - FUJI_PORT_MODEM];
+    len = std::min(len, q.size());
+    std::copy(q.begin(), q.begin() + len, data);
+    q.erase(q.begin(), q.begin() + len);
+    rxTotal -= len;
+    return len;
+}
+
+inline size_t FujiHostHandler::txUsed () const {
+    size_t n = 0;
+    for (int i = 0; i < FUJI_NUM_PORTS; i++) {
+        n += tx[i].size();
+    }
+    return n;
+}
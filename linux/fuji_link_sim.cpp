@@ -0,0 +1,1197 @@
+/****************************************************************************
+ *   mac68k-fuji-drivers (c) 2024 Marcio Teixeira                           *
+ *                                                                          *
+ *   This program is free software: you can redistribute it and/or modify   *
+ *   it under the terms of the GNU General Public License as published by   *
+ *   the Free Software Foundation, either version 3 of the License, or      *
+ *   (at your option) any later version.                                    *
+ *                                                                          *
+ *   This program is distributed in the hope that it will be useful,        *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of         *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the          *
+ *   GNU General Public License for more details.                           *
+ *                                                                          *
+ *   To view a copy of the GNU General Public License, go to the following  *
+ *   location: <http://www.gnu.org/licenses/>.                              *
+ ****************************************************************************/
+
+/**
+ * Host-side simulation of the link scheduling in FujiSerialAsync.c
+ *
+ * This models the VBL task, the completion routines and the FujiNet device
+ * on a microsecond clock, so that changes to the polling policy can be
+ * compared without a Mac on the bench. The driver logic here mirrors the
+ * C code in FujiSerialAsync.c; if you change one, change the other.
+ *
+ * To compile:
+ *
+ *    g++ -O2 -Wall -Wextra -o fuji_link_sim fuji_link_sim.cpp
+ *
+ * Usage:
+ *
+ *    ./fuji_link_sim poll [trace]   Compare polling policies on a trace
+ *    ./fuji_link_sim bulk [kbytes]  Compare receive throughput for a download
+ *    ./fuji_link_sim slow [kbytes] [bytes/sec]
+ *                                   Compare flow control for an upload to a
+ *                                   slow consumer on the host
+ *    ./fuji_link_sim ports [trace]  Compare sector scheduling between ports,
+ *                                   on the trace and on two bulk uploads
+ *    ./fuji_link_sim coalesce [bytes] [writes/sec]
+ *                                   Compare write coalescing for a Mac
+ *                                   application making small writes in
+ *                                   bursts, at the given rate
+ *    ./fuji_link_sim stream [kbytes] [bytes/sec]
+ *                                   Compare receive throughput for a host
+ *                                   that gets its data a packet at a time
+ *    ./fuji_link_sim longpoll [trace]
+ *                                   Compare long polls of a few lengths,
+ *                                   and the output they hold up, on the
+ *                                   trace and on messages sent by the host
+ *                                   at random
+ *    ./fuji_link_sim pipeline [kbytes] [gap us]
+ *                                   Compare upload throughput with and
+ *                                   without writes queued on the disk driver
+ *    ./fuji_link_sim recover        Check that output which was being
+ *                                   written when the link failed reaches
+ *                                   the host once, after reconnecting
+ *
+ * Trace files contain one event per line, "<ms> <dir> <bytes>", where dir
+ * is 'm' for bytes written by a Mac application and 'h' for bytes sent by
+ * the host to the Mac. Either may be followed by the port the bytes are
+ * for (FUJI_PORT_MODEM if omitted). Lines starting with '#' are ignored.
+ *
+ * The host end of the link is the reference implementation in
+ * fuji_host_handler.h, so the simulation exchanges real sector headers.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <deque>
+#include <vector>
+
+#include "fuji_host_handler.h"
+
+#define TICK_US         16667   // One VBL tick at 60 Hz
+#define SECTOR_US        8000   // One 512-byte transfer on the DCD bus
+#define PAYLOAD_SIZE      FUJI_PAYLOAD_SIZE
+#define SECTOR_SIZE      (FUJI_HEADER_SIZE + FUJI_PAYLOAD_SIZE)
+#define HOST_RX_DEFAULT (1L << 20) // Effectively unlimited
+
+#define VBL_TICKS_MIN       1
+#define VBL_TICKS_MAX      30
+
+#define INTERACTIVE_BYTES  32
+#define SCHED_QUANTUM     125
+
+#define LONG_POLL_IDLE      4   // LONG_POLL_IDLE_POLLS in FujiSerialAsync.c
+
+enum Policy {
+    POLL_FIXED,                 // Reload vblCount with a fixed value
+    POLL_ADAPTIVE               // nextPollInterval() in FujiSerialAsync.c
+};
+
+enum Sched {
+    SCHED_FIFO,                 // One output ring shared by all ports
+    SCHED_DRR,                  // Deficit round robin between port rings
+    SCHED_DRR_INTERACTIVE       // schedulePort() in FujiSerialAsync.c
+};
+
+struct TraceEvent {
+    long us;
+    char dir;
+    long bytes;
+    int  port = 0;              // FUJI_PORT_*, or 0 for FUJI_PORT_MODEM
+};
+
+struct Chunk {
+    long us;                    // Time the bytes reached the device
+    long bytes;
+    int  port;                  // Index into SimStats::portLatency
+};
+
+// The commands list their configurations by position, leaving out the
+// fields at the end that they do not change, which get these defaults
+
+struct SimConfig {
+    const char *name;
+    Policy      policy        = POLL_FIXED;
+    int         fixedTicks    = 0;
+    bool        chainReads    = false; // readAheadIfDrained() in FujiSerialAsync.c
+    bool        credit        = false; // Host advertises credit (see FujiLink.h)
+    long        hostRx        = 0;     // Host receive buffer, 0 for the default
+    long        consumerRate  = 0;     // Bytes/sec read by the host, 0 for unlimited
+    Sched       sched         = SCHED_FIFO;
+    int         weights[FUJI_NUM_PORTS] = {};
+    bool        writeStatus   = false; // Host returns its status with writes
+    bool        pollWaiting   = false; // linkNext() polls again for a waiting reader
+    bool        flushIdle     = false; // doPrime() sends output at once on an idle link
+    int         coalesceTicks = 0;     // FUJI_CTL_SET_COALESCE, for every port
+    long        longPollMs    = 0;     // Longest the host holds a long poll, 0 for none
+    long        requestGapUs  = 0;     // Time from a completion to the next request
+    bool        queueWrites   = false; // queueWrite() in FujiSerialAsync.c
+    bool        packSectors   = false; // packSector() in FujiSerialAsync.c
+    int         longPollIdle  = 0;     // Idle polls at VBL_TICKS_MAX before a long poll
+};
+
+struct SimStats {
+    long              polls;
+    long              emptyPolls;
+    long              skippedReads; // Not needed thanks to the write status
+    long              writes;
+    long              chained;      // Transfers started as one completed
+    long              vblStarts;    // Transfers started by the VBL task
+    long              longPolls;
+    long              heldUs;       // Time the bus spent held by long polls
+    long              queued;       // Writes queued behind the one on the bus
+    long              seqErrors;    // Sectors out of sequence, either way
+    long              bytesIn;
+    long              bytesOut;     // Accepted by the host
+    long              portBytesOut[FUJI_NUM_PORTS];
+    long              splitBytes[FUJI_NUM_PORTS]; // Sent by each port when the first ran dry
+    long              splitUs;
+    long              dropped;      // Lost to a full host buffer
+    long              endUs;
+    std::vector<long> latency; // Per-byte latency, host to Mac, in us
+    std::vector<long> portLatency[FUJI_NUM_PORTS]; // Mac to host, per port
+};
+
+class LinkSim {
+    public:
+        LinkSim (const SimConfig &cfg) :
+            cfg(cfg), host(cfg.hostRx ? cfg.hostRx : HOST_RX_DEFAULT, cfg.credit) {}
+
+        SimStats run (const std::vector<TraceEvent> &trace);
+
+    private:
+        enum Op {OP_NONE, OP_READ, OP_WRITE};
+
+        struct Write {
+            bool packed;
+            long len[FUJI_NUM_PORTS]; // Bytes from each port's ring
+            long total;
+        };
+
+        const SimConfig   &cfg;
+        SimStats           stats;
+
+        // Device side
+
+        FujiHostHandler    host;
+        std::deque<Chunk>  hostQueue[FUJI_NUM_PORTS]; // Timestamps of the bytes in host.tx
+        long               consumeUs;
+        double             consumeBudget;
+
+        // Driver side
+
+        std::deque<Chunk>  outQueue[FUJI_NUM_PORTS];
+        long               outQueued[FUJI_NUM_PORTS];
+        long               inFlight[FUJI_NUM_PORTS]; // Of outQueued, staged for writes
+        std::deque<Write>  writes;  // On the bus, then queued behind it
+        long               coalesceFrom[FUJI_NUM_PORTS];
+        long               deficit[FUJI_NUM_PORTS];
+        int                schedPort;
+        Write              staged;  // By stageWrite(), for startWrite()
+        long               writePending;
+        long               hostCredit;
+        long               readExtraAvail;
+        uint16_t           txSeq;
+        uint16_t           rxSeq;
+        bool               readDue;
+        bool               hostStreaming;
+        bool               linkActive;
+        bool               longPollOut;
+        int                idlePolls;
+        long               pollFrom;
+        int                vblCount;
+        long               nextVbl;
+        Op                 op;
+        long               opDone;
+        long               clock;
+
+        void vblTask (long now);
+        void startRead (long now);
+        void startPoll (long now);
+        bool portReady (int i);
+        int  schedulePort ();
+        bool stageWrite ();
+        void startWrite (long now);
+        void queueWrite (long now);
+        void readDone (long now);
+        void writeDone (long now);
+        bool linkNext (long now);
+        void linkIdle (long now);
+        void consume (long now);
+        int  nextPollInterval ();
+};
+
+int LinkSim::nextPollInterval () {
+    int ticks = vblCount;
+    bool ready = false;
+    for (int i = 0; i < FUJI_NUM_PORTS; i++) {
+        ready = ready || portReady(i);
+    }
+    if (linkActive || readExtraAvail || (ready && hostCredit)) {
+        ticks     = VBL_TICKS_MIN;
+        idlePolls = 0;
+    } else if (ticks < VBL_TICKS_MAX / 2) {
+        ticks <<= 1;
+    } else {
+        idlePolls += (ticks == VBL_TICKS_MAX);
+        ticks      = VBL_TICKS_MAX;
+    }
+    linkActive = false;
+    return ticks;
+}
+
+void LinkSim::startRead (long now) {
+    op      = OP_READ;
+    opDone  = now + cfg.requestGapUs + SECTOR_US;
+    readDue = false;
+    stats.polls++;
+}
+
+// startPoll() in FujiSerialAsync.c. The host answers a long poll once
+// readReady() says so; send() in the run loop asks it again.
+
+void LinkSim::startPoll (long now) {
+    bool queued = false;
+    for (int i = 0; i < FUJI_NUM_PORTS; i++) {
+        queued = queued || outQueued[i];
+    }
+    startRead (now);
+    if (cfg.longPollMs && vblCount == VBL_TICKS_MAX && idlePolls >= cfg.longPollIdle &&
+        !readExtraAvail && !queued) {
+        longPollOut = true;
+        pollFrom    = now;
+        stats.longPolls++;
+        if (!host.readReady(0)) {
+            opDone = now + cfg.requestGapUs + cfg.longPollMs * 1000 + SECTOR_US;
+        }
+    }
+}
+
+// portReady() in FujiSerialAsync.c, for what is left in the port's ring
+
+bool LinkSim::portReady (int i) {
+    const long queued = outQueued[i] - inFlight[i];
+    return queued && ((queued >= PAYLOAD_SIZE) || (clock - coalesceFrom[i] >= cfg.coalesceTicks * TICK_US));
+}
+
+// schedulePort() in FujiSerialAsync.c
+
+int LinkSim::schedulePort () {
+    if (cfg.sched == SCHED_FIFO) {
+        return portReady(0) ? 0 : -1;
+    }
+    if (cfg.sched == SCHED_DRR_INTERACTIVE) {
+        for (int i = 0; i < FUJI_NUM_PORTS; i++) {
+            if (outQueued[i] - inFlight[i] <= INTERACTIVE_BYTES && portReady(i)) {
+                return i;
+            }
+        }
+    }
+    for (int i = 0; i < 2 * FUJI_NUM_PORTS; i++) {
+        if (!portReady(schedPort)) {
+            deficit[schedPort] = 0;
+        } else if (deficit[schedPort] > 0) {
+            return schedPort;
+        }
+        schedPort = (schedPort + 1) % FUJI_NUM_PORTS;
+        if (portReady(schedPort)) {
+            deficit[schedPort] += cfg.weights[schedPort] * SCHED_QUANTUM;
+        }
+    }
+    return -1;
+}
+
+// stageWriteBuffer() in FujiSerialAsync.c
+
+bool LinkSim::stageWrite () {
+    long len = PAYLOAD_SIZE;
+    long out = 0;
+    for (const Write &w : writes) {
+        out += w.total;
+    }
+    if (hostCredit >= 0) {
+        len = std::min(len, hostCredit - std::min(hostCredit, out));
+    }
+    staged = Write();
+    const int first = len ? schedulePort () : -1;
+    if (first != -1) {
+        const long queued      = outQueued[first] - inFlight[first];
+        const bool interactive = (cfg.sched == SCHED_DRR_INTERACTIVE) && (queued <= INTERACTIVE_BYTES);
+        const bool alone       = (queued == writePending - out);
+        long       n           = len;
+        if (cfg.sched != SCHED_FIFO && !interactive && !alone) {
+            n = std::min(len, deficit[first]);
+        }
+        if (cfg.packSectors && !alone && std::min(n, queued) + 2 * FUJI_RECORD_HEADER_SIZE < len) {
+            // packSector() in FujiSerialAsync.c
+            long used = 0;
+            for (int j = 0, i = first; j < FUJI_NUM_PORTS; j++, i = (i + 1) % FUJI_NUM_PORTS) {
+                const long room = std::min(std::min(n, len), frameRoom(used, PAYLOAD_SIZE));
+                const long got  = std::min(room, outQueued[i] - inFlight[i]);
+                if (got) {
+                    staged.len[i]  = got;
+                    staged.total  += got;
+                    used          += FUJI_RECORD_HEADER_SIZE + got;
+                    deficit[i]    -= got;
+                    len           -= got;
+                }
+                n = len;
+            }
+            staged.packed = true;
+        } else {
+            staged.len[first] = std::min(n, queued);
+            staged.total      = staged.len[first];
+            deficit[first]   -= staged.total;
+        }
+    }
+    return staged.total > 0;
+}
+
+// emptyWriteBuffer() in FujiSerialAsync.c. A write queued behind another
+// starts as soon as that one is done, without the gap.
+
+void LinkSim::startWrite (long now) {
+    writes.push_back(staged);
+    for (int i = 0; i < FUJI_NUM_PORTS; i++) {
+        inFlight[i] += staged.len[i];
+    }
+    if (writes.size() == 1) {
+        op     = OP_WRITE;
+        opDone = now + cfg.requestGapUs + SECTOR_US;
+    } else {
+        stats.queued++;
+    }
+    stats.writes++;
+}
+
+// queueWrite() in FujiSerialAsync.c
+
+void LinkSim::queueWrite (long now) {
+    if (cfg.queueWrites && writes.size() == 1 && !readDue && stageWrite ()) {
+        startWrite (now);
+    }
+}
+
+void LinkSim::readDone (long now) {
+    uint8_t sector[SECTOR_SIZE];
+    host.macRead(sector);
+    if (longPollOut) {
+        stats.heldUs += now - SECTOR_US - pollFrom;
+        longPollOut   = false;
+    }
+
+    // fillReadBufDone() in FujiSerialAsync.c
+
+    const long     avail  = (sector[6] << 8) | sector[7];
+    const uint16_t credit = (sector[8] << 8) | sector[9];
+    long           n      = std::min<long>(avail, PAYLOAD_SIZE);
+    const int      port   = sector[5] ? sector[5] - FUJI_PORT_MODEM : 0;
+
+    const uint16_t seq    = (sector[10] << 8) | sector[11];
+    if (rxSeq && seq != rxSeq) {
+        stats.seqErrors++;
+    }
+    rxSeq = FUJI_SEQ(seq + 1);
+
+    hostCredit    = FUJI_HAS_CREDIT(credit) ? FUJI_CREDIT_BYTES(credit) : -1;
+    hostStreaming = n > 0;
+    if (n == 0) {
+        stats.emptyPolls++;
+    } else {
+        linkActive = true;
+    }
+    readExtraAvail = avail - n;
+    stats.bytesIn += n;
+
+    // Applications are assumed to drain the payload during the wake-up,
+    // which leaves the read buffer empty for readAheadIfDrained()
+
+    while (n > 0) {
+        Chunk &c = hostQueue[port].front();
+        long take = std::min(n, c.bytes);
+        for (long i = 0; i < take; i++) {
+            stats.latency.push_back(now - c.us);
+        }
+        c.bytes -= take;
+        n       -= take;
+        if (c.bytes == 0) {
+            hostQueue[port].pop_front();
+        }
+    }
+    op = OP_NONE;
+
+    if (cfg.chainReads && linkNext (now)) {
+        stats.chained++;
+    } else {
+        linkIdle (now);
+    }
+}
+
+void LinkSim::writeDone (long now) {
+    uint8_t     sector[SECTOR_SIZE] = {'N', 'D', 'E', 'V'};
+    const Write w = writes.front();
+
+    long        len = w.total;
+
+    writes.pop_front();
+
+    // emptyWriteBuffer() in FujiSerialAsync.c; the applications are assumed
+    // to keep up, so the credit is that of two empty read buffers. Only the
+    // record headers of a packed sector matter to the host here.
+
+    if (w.packed) {
+        len = 0;
+        for (int i = 0; i < FUJI_NUM_PORTS; i++) {
+            if (w.len[i]) {
+                frameAppend(sector + FUJI_HEADER_SIZE, &len, FUJI_PORT_MODEM + i, w.len[i]);
+            }
+        }
+        sector[4] = FUJI_PORT_PACKED;
+    } else {
+        for (int i = 0; i < FUJI_NUM_PORTS; i++) {
+            if (w.len[i]) {
+                sector[4] = FUJI_PORT_MODEM + i;
+            }
+        }
+    }
+    sector[6]  = len >> 8;
+    sector[7]  = len;
+    sector[8]  = FUJI_CREDIT(2 * PAYLOAD_SIZE) >> 8;
+    sector[9]  = FUJI_CREDIT(2 * PAYLOAD_SIZE) & 0xFF;
+    sector[10] = FUJI_SEQ(txSeq) >> 8;
+    sector[11] = FUJI_SEQ(txSeq) & 0xFF;
+    txSeq++;
+
+    const long dropped = host.dropped;
+    host.macWrote(sector);
+    stats.dropped  += host.dropped - dropped;
+    stats.bytesOut += w.total - (host.dropped - dropped);
+
+    // Account for the latency of each byte that went out
+
+    for (int ring = 0; ring < FUJI_NUM_PORTS; ring++) {
+        long n = w.len[ring];
+        while (n > 0) {
+            Chunk &c = outQueue[ring].front();
+            long take = std::min(n, c.bytes);
+            for (long i = 0; i < take; i++) {
+                stats.portLatency[c.port].push_back(now - c.us);
+            }
+            stats.portBytesOut[c.port] += take;
+            c.bytes -= take;
+            n       -= take;
+            if (c.bytes == 0) {
+                outQueue[ring].pop_front();
+            }
+        }
+        inFlight[ring]  -= w.len[ring];
+        outQueued[ring] -= w.len[ring];
+    }
+    writePending -= w.total;
+    if (hostCredit > 0) {
+        hostCredit -= std::min(hostCredit, w.total);
+    }
+
+    // Note how the ports shared the link up to when the first ran dry
+
+    if (!stats.splitUs) {
+        long left[FUJI_NUM_PORTS] = {0};
+        for (int ring = 0; ring < FUJI_NUM_PORTS; ring++) {
+            for (const Chunk &c : outQueue[ring]) {
+                left[c.port] += c.bytes;
+            }
+        }
+        for (int i = 0; i < FUJI_NUM_PORTS; i++) {
+            if (stats.portBytesOut[i] && !left[i] && writePending) {
+                std::copy(stats.portBytesOut, stats.portBytesOut + FUJI_NUM_PORTS, stats.splitBytes);
+                stats.splitUs = now;
+                break;
+            }
+        }
+    }
+    linkActive    = true;
+
+    // linkNext() reads next, unless the host said it has nothing for us
+
+    readDue = true;
+    if (cfg.writeStatus) {
+        uint8_t tags[12];
+        host.writeStatus(tags);
+
+        const uint16_t credit = (tags[4] << 8) | tags[5];
+        const uint16_t avail  = (tags[6] << 8) | tags[7];
+        hostCredit = FUJI_HAS_CREDIT(credit) ? FUJI_CREDIT_BYTES(credit) : -1;
+        if (avail == 0) {
+            readExtraAvail = 0;
+            readDue        = false;
+            stats.skippedReads++;
+        }
+    }
+
+    // wakeDriversAndReleaseMutex() leaves a queued write to run
+    if (!writes.empty()) {
+        opDone = now + SECTOR_US;
+        queueWrite (now);
+        return;
+    }
+    op = OP_NONE;
+    if (linkNext (now)) {
+        stats.chained++;
+    } else {
+        linkIdle (now);
+    }
+}
+
+// linkNext() in FujiSerialAsync.c. The applications are taken to have a
+// read waiting whenever they have drained the last one.
+
+bool LinkSim::linkNext (long now) {
+    if (readDue) {
+        startRead (now);
+    } else if (stageWrite ()) {
+        startWrite (now);
+        queueWrite (now);
+    } else if (cfg.chainReads && readExtraAvail) {
+        startRead (now);
+    } else if (cfg.pollWaiting && hostStreaming) {
+        startRead (now);
+    }
+    return op != OP_NONE;
+}
+
+// wakeDriversAndReleaseMutex() in FujiSerialAsync.c: output held back by
+// portReady() gets the VBL task run when it is due
+
+void LinkSim::linkIdle (long now) {
+    for (int i = 0; i < FUJI_NUM_PORTS; i++) {
+        if (outQueued[i] && !portReady(i)) {
+            const long due = coalesceFrom[i] + cfg.coalesceTicks * TICK_US;
+            nextVbl = std::min(nextVbl, std::max(((due + TICK_US - 1) / TICK_US) * TICK_US, now + 1));
+        }
+    }
+}
+
+void LinkSim::vblTask (long now) {
+    if (op != OP_NONE) {
+        // takeVblMutex() failed; this only sets the count of the task,
+        // not the interval nextPollInterval() works from
+        nextVbl = now + ((cfg.policy == POLL_ADAPTIVE) ? VBL_TICKS_MIN : cfg.fixedTicks) * TICK_US;
+        return;
+    }
+    vblCount = (cfg.policy == POLL_ADAPTIVE) ? nextPollInterval () : cfg.fixedTicks;
+    nextVbl  = now + vblCount * TICK_US;
+
+    if (!linkNext (now)) {
+        startPoll (now);
+    }
+    stats.vblStarts++;
+}
+
+// The application on the host reads from its end at consumerRate
+
+void LinkSim::consume (long now) {
+    uint8_t buf[4096];
+    if (cfg.consumerRate == 0) {
+        for (int port = FUJI_PORT_MODEM; port <= FUJI_NUM_PORTS; port++) {
+            while (host.receive(buf, sizeof(buf), port));
+        }
+    } else {
+        consumeBudget += (now - consumeUs) * cfg.consumerRate / 1e6;
+        long n = std::min<long>((long)consumeBudget, host.rxUsed());
+        consumeBudget -= n;
+        if (host.rxUsed() == 0) {
+            consumeBudget = 0; // An idle reader does not bank time
+        }
+        for (int port = FUJI_PORT_MODEM; port <= FUJI_NUM_PORTS && n > 0; port++) {
+            while (n > 0 && host.rxUsed(port)) {
+                n -= host.receive(buf, std::min<long>(n, sizeof(buf)), port);
+            }
+        }
+    }
+    consumeUs = now;
+}
+
+SimStats LinkSim::run (const std::vector<TraceEvent> &trace) {
+    size_t next = 0;
+
+    stats          = SimStats();
+    host.longPollMs = cfg.longPollMs;
+    for (int i = 0; i < FUJI_NUM_PORTS; i++) {
+        hostQueue[i].clear();
+    }
+    consumeUs      = 0;
+    consumeBudget  = 0;
+    for (int i = 0; i < FUJI_NUM_PORTS; i++) {
+        outQueue[i].clear();
+        outQueued[i] = 0;
+        inFlight[i]  = 0;
+        coalesceFrom[i] = 0;
+        deficit[i]   = 0;
+    }
+    schedPort      = 0;
+    writes.clear();
+    staged         = Write();
+    writePending   = 0;
+    hostCredit     = 0;     // doOpen() waits for the first reply
+    readExtraAvail = 0;
+    txSeq          = 0;
+    rxSeq          = 0;
+    readDue        = false;
+    hostStreaming  = false;
+    linkActive     = false;
+    longPollOut    = false;
+    idlePolls      = 0;
+    pollFrom       = 0;
+    vblCount       = (cfg.policy == POLL_ADAPTIVE) ? VBL_TICKS_MIN : cfg.fixedTicks;
+    nextVbl        = vblCount * TICK_US;
+    op             = OP_NONE;
+    opDone         = 0;
+    clock          = 0;
+
+    long now = 0;
+    while (next < trace.size() || host.txUsed() || writePending || op != OP_NONE) {
+        // Pick the earliest of: trace event, completion, VBL tick
+
+        long t = nextVbl;
+        if (op != OP_NONE && opDone <= t) {
+            t = opDone;
+        }
+        if (next < trace.size() && trace[next].us <= t) {
+            t = trace[next].us;
+            now = clock = t;
+            consume (now);
+            const TraceEvent &e = trace[next++];
+            if (e.dir == 'h') {
+                const int port = e.port ? e.port - FUJI_PORT_MODEM : 0;
+                Chunk c = {e.us, e.bytes, port};
+                std::vector<uint8_t> bytes(e.bytes);
+                hostQueue[port].push_back(c);
+                host.send(bytes.data(), bytes.size(), FUJI_PORT_MODEM + port);
+                if (longPollOut && opDone > now + SECTOR_US && host.readReady((now - pollFrom) / 1000)) {
+                    opDone = now + SECTOR_US;
+                }
+            } else {
+                // primeWrite() queues the bytes in the port's ring
+                const int port = e.port ? e.port - FUJI_PORT_MODEM : 0;
+                const int ring = (cfg.sched == SCHED_FIFO) ? 0 : port;
+                Chunk c = {e.us, e.bytes, port};
+                // outQueued still counts writes staged for the bus, which
+                // the driver has already taken out of the ring
+                const bool fresh = (outQueued[ring] == inFlight[ring]);
+                if (fresh) {
+                    coalesceFrom[ring] = now;
+                }
+                outQueue[ring].push_back(c);
+                outQueued[ring] += e.bytes;
+                writePending    += e.bytes;
+                if (cfg.flushIdle) {
+                    // doPrime() starts on it at once if the link is idle
+                    // and no output is held back
+                    if (op == OP_NONE && fresh) {
+                        coalesceFrom[ring] = now - cfg.coalesceTicks * TICK_US;
+                        if (!linkNext (now)) {
+                            linkIdle (now);
+                        }
+                    }
+                } else if (nextVbl > now + TICK_US) {
+                    nextVbl = ((now / TICK_US) + 1) * TICK_US;
+                }
+            }
+            continue;
+        }
+        now = clock = t;
+        consume (now);
+        if (op != OP_NONE && opDone == now) {
+            if (op == OP_READ) {
+                readDone (now);
+            } else {
+                writeDone (now);
+            }
+            continue;
+        }
+        vblTask (now);
+    }
+    stats.endUs      = now;
+    stats.seqErrors += host.duplicates + host.seqGaps;
+    return stats;
+}
+
+static bool loadTrace (const char *path, std::vector<TraceEvent> &trace) {
+    FILE *f = fopen(path, "r");
+    if (!f) {
+        printf("Error opening %s\n", path);
+        return false;
+    }
+    char line[256];
+    while (fgets(line, sizeof(line), f)) {
+        TraceEvent e = {0, 0, 0, FUJI_PORT_MODEM};
+        double ms;
+        if (line[0] == '#') continue;
+        if (sscanf(line, "%lf %c %ld %d", &ms, &e.dir, &e.bytes, &e.port) >= 3) {
+            e.us = (long)(ms * 1000);
+            trace.push_back(e);
+        }
+    }
+    fclose(f);
+    std::stable_sort(trace.begin(), trace.end(),
+        [](const TraceEvent &a, const TraceEvent &b) {return a.us < b.us;});
+    return true;
+}
+
+static long percentile (std::vector<long> &v, double p) {
+    if (v.empty()) return 0;
+    std::sort(v.begin(), v.end());
+    size_t i = (size_t)(p * (v.size() - 1));
+    return v[i];
+}
+
+static double mean (const std::vector<long> &v) {
+    double sum = 0;
+    for (long x : v) sum += x;
+    return v.empty() ? 0 : sum / v.size();
+}
+
+static int cmdPoll (const char *tracePath) {
+    std::vector<TraceEvent> trace;
+    if (!loadTrace(tracePath, trace)) {
+        return -1;
+    }
+
+    const SimConfig configs[] = {
+        {"fixed 30 ticks", POLL_FIXED,    30, false},
+        {"fixed 15 ticks", POLL_FIXED,    15, false},
+        {"fixed 1 tick",   POLL_FIXED,     1, false},
+        {"adaptive 1-30",  POLL_ADAPTIVE,  0, false},
+        {"adaptive+chain", POLL_ADAPTIVE,  0, true},
+        {"+write status",  POLL_ADAPTIVE,  0, true, false, 0, 0, SCHED_FIFO, {4, 4, 4}, true},
+        {"+poll waiting",  POLL_ADAPTIVE,  0, true, false, 0, 0, SCHED_FIFO, {4, 4, 4}, true, true}
+    };
+
+    printf("Trace: %s (%zu events)\n\n", tracePath, trace.size());
+    printf("%-16s %8s %8s %8s %10s %10s %10s\n", "policy", "polls", "empty", "skipped", "mean ms", "p95 ms", "max ms");
+    for (const SimConfig &cfg : configs) {
+        LinkSim  sim(cfg);
+        SimStats s = sim.run(trace);
+        printf("%-16s %8ld %8ld %8ld %10.1f %10.1f %10.1f\n", cfg.name, s.polls, s.emptyPolls, s.skippedReads,
+            mean(s.latency) / 1000,
+            percentile(s.latency, 0.95) / 1000.0,
+            percentile(s.latency, 1.0)  / 1000.0);
+    }
+    return 0;
+}
+
+static int cmdBulk (long kbytes) {
+    // A download: the host has the whole file queued a second into the run
+
+    std::vector<TraceEvent> trace;
+    for (long i = 0; i < kbytes; i++) {
+        TraceEvent e = {1000000, 'h', 1024};
+        trace.push_back(e);
+    }
+
+    const SimConfig configs[] = {
+        {"fixed 30 ticks", POLL_FIXED,    30, false},
+        {"fixed 30+chain", POLL_FIXED,    30, true},
+        {"adaptive 1-30",  POLL_ADAPTIVE,  0, false},
+        {"adaptive+chain", POLL_ADAPTIVE,  0, true}
+    };
+
+    printf("Download of %ld Kbytes, %d us per sector\n\n", kbytes, SECTOR_US);
+    printf("%-16s %8s %10s %12s\n", "policy", "polls", "secs", "bytes/sec");
+    for (const SimConfig &cfg : configs) {
+        LinkSim  sim(cfg);
+        SimStats s = sim.run(trace);
+        double secs = (s.endUs - 1000000) / 1e6;
+        printf("%-16s %8ld %10.2f %12.0f\n", cfg.name, s.polls, secs, s.bytesIn / secs);
+    }
+    return 0;
+}
+
+static int cmdSlow (long kbytes, long rate) {
+    // An upload to a host application that reads slower than the link
+    // can deliver, through a small receive buffer on the FujiNet
+
+    std::vector<TraceEvent> trace;
+    for (long i = 0; i < kbytes; i++) {
+        TraceEvent e = {1000000, 'm', 1024};
+        trace.push_back(e);
+    }
+
+    const SimConfig configs[] = {
+        {"no credit",      POLL_ADAPTIVE,  0, true, false, 2048, rate},
+        {"credit",         POLL_ADAPTIVE,  0, true, true,  2048, rate},
+        {"credit, 8K buf", POLL_ADAPTIVE,  0, true, true,  8192, rate}
+    };
+
+    printf("Upload of %ld Kbytes to a host reading %ld bytes/sec\n\n", kbytes, rate);
+    printf("%-16s %8s %10s %10s %8s %12s\n", "policy", "writes", "secs", "dropped", "loss", "goodput B/s");
+    for (const SimConfig &cfg : configs) {
+        LinkSim  sim(cfg);
+        SimStats s = sim.run(trace);
+        double secs = (s.endUs - 1000000) / 1e6;
+        printf("%-16s %8ld %10.2f %10ld %7.1f%% %12.0f\n", cfg.name, s.writes, secs, s.dropped,
+            100.0 * s.dropped / (s.bytesOut + s.dropped), s.bytesOut / secs);
+    }
+    return 0;
+}
+
+static int cmdPorts (const char *tracePath) {
+    std::vector<TraceEvent> trace;
+    if (!loadTrace(tracePath, trace)) {
+        return -1;
+    }
+
+    const SimConfig configs[] = {
+        {"shared ring",    POLL_ADAPTIVE,  0, true, true, 0, 0, SCHED_FIFO,            {4, 4, 4}},
+        {"drr 4:4",        POLL_ADAPTIVE,  0, true, true, 0, 0, SCHED_DRR,             {4, 4, 4}},
+        {"drr 1:8",        POLL_ADAPTIVE,  0, true, true, 0, 0, SCHED_DRR,             {1, 8, 4}},
+        {"drr 1:8+inter",  POLL_ADAPTIVE,  0, true, true, 0, 0, SCHED_DRR_INTERACTIVE, {1, 8, 4}},
+        {"+packed",        POLL_ADAPTIVE,  0, true, true, 0, 0, SCHED_DRR_INTERACTIVE, {1, 8, 4},
+                           false, false, false, 0, 0, 0, false, true}
+    };
+    const char *portNames[FUJI_NUM_PORTS] = {"modem", "printer", "other"};
+
+    printf("Trace: %s (%zu events)\n\n", tracePath, trace.size());
+    printf("%-16s %-8s %8s %10s %10s %10s %10s\n", "policy", "port", "bytes", "p50 ms", "p95 ms", "p99 ms", "max ms");
+    for (const SimConfig &cfg : configs) {
+        LinkSim  sim(cfg);
+        SimStats s = sim.run(trace);
+        for (int i = 0; i < FUJI_NUM_PORTS; i++) {
+            std::vector<long> &v = s.portLatency[i];
+            if (v.empty()) continue;
+            printf("%-16s %-8s %8zu %10.1f %10.1f %10.1f %10.1f\n", cfg.name, portNames[i], v.size(),
+                percentile(v, 0.50) / 1000.0,
+                percentile(v, 0.95) / 1000.0,
+                percentile(v, 0.99) / 1000.0,
+                percentile(v, 1.0)  / 1000.0);
+        }
+    }
+
+    // Two bulk uploads at once, which only the weights decide between
+
+    std::vector<TraceEvent> bulk;
+    for (long i = 0; i < 32; i++) {
+        TraceEvent modem   = {1000000, 'm', 1024, FUJI_PORT_MODEM};
+        TraceEvent printer = {1000000, 'm', 1024, FUJI_PORT_PRINTER};
+        bulk.push_back(modem);
+        bulk.push_back(printer);
+    }
+
+    printf("\nUploads of 32 Kbytes on the modem and printer ports at once\n\n");
+    printf("%-16s %8s %10s %10s %10s %12s\n", "policy", "weights", "modem", "printer", "modem %", "bytes/sec");
+    for (const SimConfig &cfg : configs) {
+        if (cfg.sched == SCHED_FIFO) continue;
+        LinkSim  sim(cfg);
+        SimStats s = sim.run(bulk);
+        const long both = s.splitBytes[0] + s.splitBytes[1];
+        char weights[16];
+        snprintf(weights, sizeof(weights), "%d:%d", cfg.weights[0], cfg.weights[1]);
+        printf("%-16s %8s %10ld %10ld %9.1f%% %12.0f\n", cfg.name, weights, s.splitBytes[0], s.splitBytes[1],
+            both ? 100.0 * s.splitBytes[0] / both : 0.0,
+            (s.portBytesOut[0] + s.portBytesOut[1]) / ((s.endUs - 1000000) / 1e6));
+    }
+    return 0;
+}
+
+static int cmdStream (long kbytes, long rate) {
+    // A download from a host that gets its data off the network a packet
+    // at a time, rather than having it all queued up front as in cmdBulk
+
+    const long packet = 256;
+    std::vector<TraceEvent> trace;
+    for (long i = 0; i < kbytes * 1024 / packet; i++) {
+        TraceEvent e = {1000000 + (long)(i * packet * 1e6 / rate), 'h', packet};
+        trace.push_back(e);
+    }
+
+    const SimConfig configs[] = {
+        {"adaptive+chain", POLL_ADAPTIVE,  0, true},
+        {"+poll waiting",  POLL_ADAPTIVE,  0, true, false, 0, 0, SCHED_FIFO, {4, 4, 4}, false, true}
+    };
+
+    printf("Download of %ld Kbytes arriving at %ld bytes/sec, link carries %.0f bytes/sec\n\n",
+        kbytes, rate, PAYLOAD_SIZE * 1e6 / SECTOR_US);
+    printf("%-16s %8s %8s %8s %8s %10s %12s %10s %10s\n", "policy", "polls", "empty", "chained", "by vbl", "secs", "bytes/sec", "mean ms", "p95 ms");
+    for (const SimConfig &cfg : configs) {
+        LinkSim  sim(cfg);
+        SimStats s = sim.run(trace);
+        double secs = (s.endUs - 1000000) / 1e6;
+        printf("%-16s %8ld %8ld %8ld %8ld %10.2f %12.0f %10.1f %10.1f\n", cfg.name, s.polls, s.emptyPolls,
+            s.chained, s.vblStarts, secs, s.bytesIn / secs,
+            mean(s.latency) / 1000,
+            percentile(s.latency, 0.95) / 1000.0);
+    }
+    return 0;
+}
+
+static int cmdCoalesce (long bytes, long rate) {
+    // Ten seconds of small writes, such as an application printing a few
+    // lines at a time, with nothing coming back. Each burst of writes comes
+    // faster than one per sector time, so that most arrive while the link
+    // is busy, which is when coalescing has something to do; the first of
+    // each arrives on an idle link, which is when flushing does. The bursts
+    // start at random, so that they do not keep in step with the ticks.
+
+    const long burst = 10;
+    std::vector<TraceEvent> trace;
+    srand(1);
+    for (long us = 1000000; us < 11000000; us += 200000 + rand() % 100000) {
+        for (long i = 0; i < burst; i++) {
+            TraceEvent e = {us + (long)(i * 1e6 / rate), 'm', bytes};
+            trace.push_back(e);
+        }
+    }
+
+    const SimConfig configs[] = {
+        {"next tick",      POLL_ADAPTIVE,  0, true, true, 0, 0, SCHED_DRR_INTERACTIVE, {4, 4, 4}, true, true},
+        {"flush idle",     POLL_ADAPTIVE,  0, true, true, 0, 0, SCHED_DRR_INTERACTIVE, {4, 4, 4}, true, true, true, 0},
+        {"coalesce 1",     POLL_ADAPTIVE,  0, true, true, 0, 0, SCHED_DRR_INTERACTIVE, {4, 4, 4}, true, true, true, 1},
+        {"coalesce 3",     POLL_ADAPTIVE,  0, true, true, 0, 0, SCHED_DRR_INTERACTIVE, {4, 4, 4}, true, true, true, 3},
+        {"coalesce 10",    POLL_ADAPTIVE,  0, true, true, 0, 0, SCHED_DRR_INTERACTIVE, {4, 4, 4}, true, true, true, 10}
+    };
+
+    printf("Bursts of %ld writes of %ld bytes, %ld per second\n\n", burst, bytes, rate);
+    printf("%-16s %8s %8s %8s %10s %10s %10s %10s\n", "policy", "writes", "polls", "sectors", "B/write", "mean ms", "p95 ms", "max ms");
+    for (const SimConfig &cfg : configs) {
+        LinkSim  sim(cfg);
+        SimStats s = sim.run(trace);
+        std::vector<long> &v = s.portLatency[0];
+        printf("%-16s %8ld %8ld %8ld %10.1f %10.1f %10.1f %10.1f\n", cfg.name, s.writes, s.polls, s.writes + s.polls,
+            s.writes ? (double) s.bytesOut / s.writes : 0.0,
+            mean(v) / 1000,
+            percentile(v, 0.95) / 1000.0,
+            percentile(v, 1.0)  / 1000.0);
+    }
+    return 0;
+}
+
+static int cmdLongPoll (const char *tracePath) {
+    std::vector<TraceEvent> traces[2];
+    if (!loadTrace(tracePath, traces[0])) {
+        return -1;
+    }
+
+    // A minute of short messages that the host sends unprompted, such as
+    // chat lines or notifications, a few seconds apart on average
+
+    srand(1);
+    for (long us = 1000000; us < 61000000; us += 500000 + rand() % 5000000) {
+        TraceEvent e = {us, 'h', 40};
+        traces[1].push_back(e);
+    }
+
+    // Long polls are sent once the link has been idle for LONG_POLL_IDLE
+    // polls, as the driver does; the "no wait" one is sent as soon as
+    // polling has backed off, which holds up the Mac's output more often
+
+    const SimConfig configs[] = {
+        {"+poll waiting",  POLL_ADAPTIVE,  0, true, false, 0, 0, SCHED_FIFO, {4, 4, 4}, true, true, true, 0},
+        {"500, no wait",   POLL_ADAPTIVE,  0, true, false, 0, 0, SCHED_FIFO, {4, 4, 4}, true, true, true, 0, 500},
+        {"long poll 100",  POLL_ADAPTIVE,  0, true, false, 0, 0, SCHED_FIFO, {4, 4, 4}, true, true, true, 0, 100,
+                           0, false, false, LONG_POLL_IDLE},
+        {"long poll 250",  POLL_ADAPTIVE,  0, true, false, 0, 0, SCHED_FIFO, {4, 4, 4}, true, true, true, 0, 250,
+                           0, false, false, LONG_POLL_IDLE},
+        {"long poll 500",  POLL_ADAPTIVE,  0, true, false, 0, 0, SCHED_FIFO, {4, 4, 4}, true, true, true, 0, 500,
+                           0, false, false, LONG_POLL_IDLE}
+    };
+    const char *names[2] = {tracePath, "host messages"};
+
+    // The cost of a long poll is the output it holds up, shown as the
+    // latency from Mac to host over that of short polls alone
+
+    for (int i = 0; i < 2; i++) {
+        double baseMean = 0, baseP95 = 0;
+        printf("%sTrace: %s (%zu events)\n\n", i ? "\n" : "", names[i], traces[i].size());
+        printf("%-16s %8s %8s %8s %8s %17s | %-21s | %-21s\n", "", "", "", "", "", "extra out", "host to Mac", "Mac to host");
+        printf("%-16s %8s %8s %8s %8s %8s %8s | %10s %10s | %10s %10s\n", "policy", "polls", "empty", "long", "held",
+            "mean ms", "p95 ms", "mean ms", "p95 ms", "mean ms", "p95 ms");
+        for (const SimConfig &cfg : configs) {
+            LinkSim  sim(cfg);
+            SimStats s = sim.run(traces[i]);
+            std::vector<long> &out = s.portLatency[0];
+            const double outMean = mean(out) / 1000;
+            const double outP95  = percentile(out, 0.95) / 1000.0;
+            if (&cfg == configs) {
+                baseMean = outMean;
+                baseP95  = outP95;
+            }
+            printf("%-16s %8ld %8ld %8ld %7.1f%% %8.1f %8.1f | %10.1f %10.1f | %10.1f %10.1f\n", cfg.name, s.polls, s.emptyPolls,
+                s.longPolls, 100.0 * s.heldUs / s.endUs,
+                outMean - baseMean, outP95 - baseP95,
+                mean(s.latency) / 1000,
+                percentile(s.latency, 0.95) / 1000.0,
+                outMean, outP95);
+        }
+    }
+    return 0;
+}
+
+static int cmdPipeline (long kbytes, long gapUs) {
+    // An upload to a host that keeps up, with the time the driver takes
+    // between a completion and its next request charged to every request
+    // it starts
+
+    std::vector<TraceEvent> trace;
+    for (long i = 0; i < kbytes; i++) {
+        TraceEvent e = {1000000, 'm', 1024};
+        trace.push_back(e);
+    }
+
+    const SimConfig configs[] = {
+        {"no gap",         POLL_ADAPTIVE,  0, true, true, 0, 0, SCHED_DRR_INTERACTIVE, {4, 4, 4}, true, true, true, 0, 0, 0},
+        {"one at a time",  POLL_ADAPTIVE,  0, true, true, 0, 0, SCHED_DRR_INTERACTIVE, {4, 4, 4}, true, true, true, 0, 0, gapUs},
+        {"queued writes",  POLL_ADAPTIVE,  0, true, true, 0, 0, SCHED_DRR_INTERACTIVE, {4, 4, 4}, true, true, true, 0, 0, gapUs, true}
+    };
+
+    printf("Upload of %ld Kbytes, %d us per sector, %ld us from a completion to the next request\n\n",
+        kbytes, SECTOR_US, gapUs);
+    printf("%-16s %8s %8s %10s %12s %8s %8s\n", "policy", "writes", "queued", "secs", "bytes/sec", "writing", "seq err");
+    for (const SimConfig &cfg : configs) {
+        LinkSim  sim(cfg);
+        SimStats s = sim.run(trace);
+        double secs = (s.endUs - 1000000) / 1e6;
+        printf("%-16s %8ld %8ld %10.2f %12.0f %7.1f%% %8ld\n", cfg.name, s.writes, s.queued, secs,
+            s.bytesOut / secs,
+            100.0 * s.writes * SECTOR_US / (s.endUs - 1000000),
+            s.seqErrors);
+    }
+    return 0;
+}
+
+// A write from the Mac that fails part way: the sectors before the error
+// reach the host, the rest are lost. The Mac then knocks and sends again
+// what it kept, as linkRecovered() in FujiSerialAsync.c has it do.
+
+struct RecoverCase {
+    const char *name;
+    bool        direct;         // A direct write, else from the write buffers
+    long        sectors;        // In the write that fails
+    long        arrive;         // Of these, reach the host before the error
+    bool        queued;         // A write queued behind it gets through
+    bool        sameSeq;        // Sent again with its old numbers
+};
+
+// Sends one sector of a write numbered from seq, the k-th of a direct
+// write, or a sector of the write buffers, with the payload for offset
+
+static void recoverSector (FujiHostHandler &host, bool direct, uint16_t seq, long k, long offset) {
+    uint8_t sector[SECTOR_SIZE] = {'N', 'D', 'E', 'V', FUJI_PORT_MODEM};
+    uint8_t tags[12]            = {'N', 'D', 'E', 'V', FUJI_PORT_MODEM};
+    uint8_t *header  = direct ? tags : sector;
+    uint8_t *payload = direct ? sector : sector + FUJI_HEADER_SIZE;
+    const long len   = direct ? SECTOR_SIZE : PAYLOAD_SIZE;
+
+    for (long i = 0; i < len; i++) {
+        payload[i] = (offset + i) % 251;
+    }
+    header[6]  = len >> 8;
+    header[7]  = len & 0xFF;
+    header[8]  = FUJI_CREDIT(2 * PAYLOAD_SIZE) >> 8;
+    header[9]  = FUJI_CREDIT(2 * PAYLOAD_SIZE) & 0xFF;
+    header[10] = FUJI_SEQ(direct ? seq : seq + k) >> 8;
+    header[11] = FUJI_SEQ(direct ? seq : seq + k) & 0xFF;
+    host.macWrote(sector, direct ? tags : 0);
+}
+
+static int cmdRecover () {
+    const RecoverCase cases[] = {
+        {"buffers",         false, 2, 1, false, true},
+        {"buffers+queued",  false, 2, 1, true,  true},
+        {"direct",          true,  4, 2, false, true},
+        {"direct, renumber", true, 4, 2, false, false}
+    };
+    int failed = 0;
+
+    printf("A write to the host fails part way, and is sent again after a knock\n\n");
+    printf("%-18s %8s %8s %8s %8s %8s\n", "write", "bytes", "got", "dups", "gaps", "result");
+    for (const RecoverCase &c : cases) {
+        FujiHostHandler host(HOST_RX_DEFAULT, true);
+        const long      size = c.direct ? SECTOR_SIZE : PAYLOAD_SIZE;
+        uint16_t        seq  = 100;
+        long            from = 0;
+
+        // A write that gets through, so that the host has a number to expect
+        recoverSector(host, false, seq++, 0, from);
+        from += PAYLOAD_SIZE;
+
+        // The write that fails, and the one queued behind it
+        for (long k = 0; k < c.arrive; k++) {
+            recoverSector(host, c.direct, seq, k, from + k * size);
+        }
+        if (c.queued) {
+            recoverSector(host, false, seq + c.sectors, 0, from + c.sectors * size);
+        }
+
+        // Both are sent again once the link is back
+        host.macKnocked();
+        const uint16_t again = c.sameSeq ? seq : seq + c.sectors + c.queued;
+        for (long k = 0; k < c.sectors; k++) {
+            recoverSector(host, c.direct, again, k, from + k * size);
+        }
+        if (c.queued) {
+            recoverSector(host, false, again + c.sectors, 0, from + c.sectors * size);
+        }
+
+        const long total = from + c.sectors * size + (c.queued ? PAYLOAD_SIZE : 0);
+        std::vector<uint8_t> got(total + 2 * SECTOR_SIZE);
+        const long n = host.receive(got.data(), got.size());
+        bool inOrder = true;
+        for (long i = 0; i < std::min(n, total); i++) {
+            inOrder = inOrder && (got[i] == i % 251);
+        }
+        const char *result = (n > total) ? "twice" : (n < total) ? "lost" : inOrder ? "once" : "garbled";
+        printf("%-18s %8ld %8ld %8ld %8ld %8s\n", c.name, total, n, host.duplicates, host.seqGaps, result);
+
+        // Only the driver's own way of sending again must get it there once
+        if (c.sameSeq && (n != total || !inOrder)) {
+            failed++;
+        }
+    }
+    return failed ? -1 : 0;
+}
+
+int main (int argc, char *argv[]) {
+    if (argc >= 2 && strcmp(argv[1], "poll") == 0) {
+        return cmdPoll (argc >= 3 ? argv[2] : "traces/terminal_session.trace");
+    }
+    if (argc >= 2 && strcmp(argv[1], "bulk") == 0) {
+        return cmdBulk (argc >= 3 ? atol(argv[2]) : 64);
+    }
+    if (argc >= 2 && strcmp(argv[1], "ports") == 0) {
+        return cmdPorts (argc >= 3 ? argv[2] : "traces/modem_and_printer.trace");
+    }
+    if (argc >= 2 && strcmp(argv[1], "slow") == 0) {
+        return cmdSlow (argc >= 3 ? atol(argv[2]) : 64, argc >= 4 ? atol(argv[3]) : 4000);
+    }
+    if (argc >= 2 && strcmp(argv[1], "coalesce") == 0) {
+        return cmdCoalesce (argc >= 3 ? atol(argv[2]) : 16, argc >= 4 ? atol(argv[3]) : 200);
+    }
+    if (argc >= 2 && strcmp(argv[1], "stream") == 0) {
+        return cmdStream (argc >= 3 ? atol(argv[2]) : 256, argc >= 4 ? atol(argv[3]) : 50000);
+    }
+    if (argc >= 2 && strcmp(argv[1], "longpoll") == 0) {
+        return cmdLongPoll (argc >= 3 ? argv[2] : "traces/terminal_session.trace");
+    }
+    if (argc >= 2 && strcmp(argv[1], "pipeline") == 0) {
+        return cmdPipeline (argc >= 3 ? atol(argv[2]) : 64, argc >= 4 ? atol(argv[3]) : 2000);
+    }
+    if (argc >= 2 && strcmp(argv[1], "recover") == 0) {
+        return cmdRecover ();
+    }
+    printf("Usage: %s poll [trace]\n", argv[0]);
+    printf("       %s bulk [kbytes]\n", argv[0]);
+    printf("       %s slow [kbytes] [bytes/sec]\n", argv[0]);
+    printf("       %s ports [trace]\n", argv[0]);
+    printf("       %s coalesce [bytes] [writes/sec]\n", argv[0]);
+    printf("       %s stream [kbytes] [bytes/sec]\n", argv[0]);
+    printf("       %s longpoll [trace]\n", argv[0]);
+    printf("       %s pipeline [kbytes] [gap us]\n", argv[0]);
+    printf("       %s recover\n", argv[0]);
+    return -1;
+}
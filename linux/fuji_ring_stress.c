@@ -0,0 +1,148 @@
+/****************************************************************************
+ *   mac68k-fuji-drivers (c) 2024 Marcio Teixeira                           *
+ *                                                                          *
+ *   This program is free software: you can redistribute it and/or modify   *
+ *   it under the terms of the GNU General Public License as published by   *
+ *   the Free Software Foundation, either version 3 of the License, or      *
+ *   (at your option) any later version.                                    *
+ *                                                                          *
+ *   This program is distributed in the hope that it will be useful,        *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of         *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the          *
+ *   GNU General Public License for more details.                           *
+ *                                                                          *
+ *   To view a copy of the GNU General Public License, go to the following  *
+ *   location: <http://www.gnu.org/licenses/>.                              *
+ ****************************************************************************/
+
+/**
+ * Stress test for putting into and taking from a ring at the same time
+ * without a mutex, as described in FujiCommon/FujiRingOps.h.
+ *
+ * Two threads stand in for an application and for interrupt code. As in
+ * the Async driver, the application puts into an output ring which the
+ * interrupt code takes from, and the interrupt code puts into an input ring
+ * which the application takes from. Each side puts and takes chunks of
+ * random sizes, from single bytes up to more than a sector, and checks that
+ * the bytes it takes are the ones put, in order. The rings are given odd
+ * sizes so that copies often wrap.
+ *
+ * This is plain C, like the code it exercises. To compile:
+ *
+ *    gcc -O2 -pthread -o fuji_ring_stress fuji_ring_stress.c
+ *
+ * Usage:
+ *
+ *    ./fuji_ring_stress [megabytes]
+ */
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Copies sometimes give up the processor halfway, so that on a machine with
+ * only one the other side gets to run between reading the indices and
+ * storing them, which is where a mistake in their order would show */
+
+static __thread unsigned int copies;
+
+static void stressCopy (const void *src, void *dst, long len) {
+	const long half = len / 2;
+	memmove (dst, src, half);
+	if ((++copies & 7) == 0) {
+		sched_yield ();
+	}
+	memmove ((char *) dst + half, (const char *) src + half, len - half);
+}
+
+#define FUJI_RING_COPY(src, dst, len) stressCopy (src, dst, len)
+#define FUJI_RING_BARRIER() __sync_synchronize ()
+
+#include "../FujiCommon/FujiRingOps.h"
+
+#define OUT_RING_SIZE 4099
+#define IN_RING_SIZE  1021
+#define MAX_CHUNK      600
+
+struct Side {
+	const char      *name;
+	struct FujiRing *putRing;
+	struct FujiRing *getRing;
+	unsigned int     seed;
+	long             total;     // Bytes to put, and to take
+	unsigned char    nextOut;   // Pattern byte for the next byte put
+	unsigned char    nextIn;    // Pattern byte expected for the next byte taken
+	long             put, got;
+	long             errors;
+	long             spins;     // Passes that moved nothing
+};
+
+static void *runSide (void *arg) {
+	struct Side  *side = (struct Side *) arg;
+	char          chunk[MAX_CHUNK];
+	long          i;
+
+	while (side->put < side->total || side->got < side->total) {
+		long moved = 0;
+
+		if (side->put < side->total) {
+			long n = 1 + rand_r (&side->seed) % MAX_CHUNK;
+			if (n > side->total - side->put) {
+				n = side->total - side->put;
+			}
+			for (i = 0; i < n; i++) {
+				chunk[i] = (char) (side->nextOut + i);
+			}
+			n = ringPut (side->putRing, chunk, n);
+			side->nextOut += (unsigned char) n;
+			side->put     += n;
+			moved         += n;
+		}
+		if (side->got < side->total) {
+			const long n = ringGet (side->getRing, chunk, 1 + rand_r (&side->seed) % MAX_CHUNK);
+			for (i = 0; i < n; i++) {
+				if ((unsigned char) chunk[i] != side->nextIn++) {
+					side->errors++;
+				}
+			}
+			side->got += n;
+			moved     += n;
+		}
+		if (moved == 0) {
+			// Let the other side run, should there be only one processor
+			side->spins++;
+			sched_yield ();
+		}
+	}
+	return NULL;
+}
+
+int main (int argc, char **argv) {
+	const long      total = ((argc > 1) ? atol (argv[1]) : 64) * 1024L * 1024L;
+	static char     outBuffer[OUT_RING_SIZE], inBuffer[IN_RING_SIZE];
+	struct FujiRing outRing = {outBuffer, OUT_RING_SIZE, 0, 0};
+	struct FujiRing inRing  = {inBuffer,  IN_RING_SIZE,  0, 0};
+	struct Side     app     = {"application", &outRing, &inRing,  1, 0, 0, 0, 0, 0, 0, 0};
+	struct Side     irq     = {"interrupt",   &inRing,  &outRing, 2, 0, 0, 0, 0, 0, 0, 0};
+	pthread_t       appThread, irqThread;
+
+	app.total = total;
+	irq.total = total;
+
+	pthread_create (&appThread, NULL, runSide, &app);
+	pthread_create (&irqThread, NULL, runSide, &irq);
+	pthread_join (appThread, NULL);
+	pthread_join (irqThread, NULL);
+
+	printf ("%-12s put %ld, took %ld, %ld errors, %ld idle passes\n", app.name, app.put, app.got, app.errors, app.spins);
+	printf ("%-12s put %ld, took %ld, %ld errors, %ld idle passes\n", irq.name, irq.put, irq.got, irq.errors, irq.spins);
+
+	if (app.errors || irq.errors || ringUsed (&outRing) || ringUsed (&inRing)) {
+		printf ("FAILED\n");
+		return 1;
+	}
+	printf ("OK\n");
+	return 0;
+}